@@ -1,7 +1,7 @@
 #if _MSC_VER
 #include <intrin.h>
 #else
-#include <x86itrin.h>
+#include <x86intrin.h>
 #endif
 #include <signal.h>
 #include <math.h>
@@ -133,3 +133,175 @@ f64 haversine_distance(pair_t *p, f64 R)
 
     RETURN_VAL(_s, result);
 }
+
+// Reference version on top of libm, same formula as python/haversine_json.py
+static f64 reference_haversine(f64 x0, f64 y0, f64 x1, f64 y1, f64 R)
+{
+    f64 dY = deg2rad(y1 - y0);
+    f64 dX = deg2rad(x1 - x0);
+    f64 lat0 = deg2rad(y0);
+    f64 lat1 = deg2rad(y1);
+
+    f64 root_term = Square(sin(dY / 2.0)) + cos(lat0) * cos(lat1) * Square(sin(dX / 2.0));
+    return 2.0 * R * asin(sqrt(root_term));
+}
+
+// === BATCH HAVERSINE ===
+// Same math as haversine_distance, but evaluated over 4 (AVX2) or 8 (AVX-512) pairs per instruction.
+// The ternaries become compare + blend, and every op is the same IEEE op in the same order as the scalar
+// version (fma is fused in both, sqrt is correctly rounded in both), so the results are bit-for-bit identical.
+#if defined(__AVX512F__)
+#define HAVERSINE_LANES 8
+typedef __m512d vf64;
+typedef __mmask8 vmask;
+#define V_SET1(x) _mm512_set1_pd(x)
+#define V_LOAD(p) _mm512_loadu_pd(p)
+#define V_STORE(p, x) _mm512_storeu_pd((p), (x))
+#define V_FMA(a, b, c) _mm512_fmadd_pd((a), (b), (c))
+#define V_MUL(a, b) _mm512_mul_pd((a), (b))
+#define V_SUB(a, b) _mm512_sub_pd((a), (b))
+#define V_SQRT(x) _mm512_sqrt_pd(x)
+#define V_ABS(x) _mm512_abs_pd(x)
+#define V_LT(a, b) _mm512_cmp_pd_mask((a), (b), _CMP_LT_OQ)
+#define V_GT(a, b) _mm512_cmp_pd_mask((a), (b), _CMP_GT_OQ)
+#define V_SELECT(m, t, f) _mm512_mask_blend_pd((m), (f), (t))
+#elif defined(__AVX2__)
+#define HAVERSINE_LANES 4
+typedef __m256d vf64;
+typedef __m256d vmask;
+#define V_SET1(x) _mm256_set1_pd(x)
+#define V_LOAD(p) _mm256_loadu_pd(p)
+#define V_STORE(p, x) _mm256_storeu_pd((p), (x))
+#define V_FMA(a, b, c) _mm256_fmadd_pd((a), (b), (c))
+#define V_MUL(a, b) _mm256_mul_pd((a), (b))
+#define V_SUB(a, b) _mm256_sub_pd((a), (b))
+#define V_SQRT(x) _mm256_sqrt_pd(x)
+#define V_ABS(x) _mm256_andnot_pd(_mm256_set1_pd(-0.0), (x))
+#define V_LT(a, b) _mm256_cmp_pd((a), (b), _CMP_LT_OQ)
+#define V_GT(a, b) _mm256_cmp_pd((a), (b), _CMP_GT_OQ)
+#define V_SELECT(m, t, f) _mm256_blendv_pd((f), (t), (m))
+#else
+#define HAVERSINE_LANES 1
+#endif
+
+#if HAVERSINE_LANES > 1
+static inline vf64 asin_v(vf64 X2)
+{
+    vf64 X = V_SQRT(X2);
+
+    vf64 R = V_SET1(0x1.dfc53682725cap-1);
+    R = V_FMA(R, X2, V_SET1(-0x1.bec6daf74ed61p1));
+    R = V_FMA(R, X2, V_SET1(0x1.8bf4dadaf548cp2));
+    R = V_FMA(R, X2, V_SET1(-0x1.b06f523e74f33p2));
+    R = V_FMA(R, X2, V_SET1(0x1.4537ddde2d76dp2));
+    R = V_FMA(R, X2, V_SET1(-0x1.6067d334b4792p1));
+    R = V_FMA(R, X2, V_SET1(0x1.1fb54da575b22p0));
+    R = V_FMA(R, X2, V_SET1(-0x1.57380bcd2890ep-2));
+    R = V_FMA(R, X2, V_SET1(0x1.69b370aad086ep-4));
+    R = V_FMA(R, X2, V_SET1(-0x1.21438ccc95d62p-8));
+    R = V_FMA(R, X2, V_SET1(0x1.b8a33b8e380efp-7));
+    R = V_FMA(R, X2, V_SET1(0x1.c37061f4e5f55p-7));
+    R = V_FMA(R, X2, V_SET1(0x1.1c875d6c5323dp-6));
+    R = V_FMA(R, X2, V_SET1(0x1.6e88ce94d1149p-6));
+    R = V_FMA(R, X2, V_SET1(0x1.f1c73443a02f5p-6));
+    R = V_FMA(R, X2, V_SET1(0x1.6db6db3184756p-5));
+    R = V_FMA(R, X2, V_SET1(0x1.3333333380df2p-4));
+    R = V_FMA(R, X2, V_SET1(0x1.555555555531ep-3));
+    R = V_FMA(R, X2, V_SET1(0x1p0));
+    R = V_MUL(R, X);
+
+    return R;
+}
+
+static inline vf64 SineCoreWithPrefix_v(vf64 A, vf64 B, vf64 C)
+{
+    vf64 X = V_FMA(A, B, C);
+    vf64 X2 = V_MUL(X, X);
+
+    vf64 R = V_SET1(0x1.883c1c5deffbep-49);
+    R = V_FMA(R, X2, V_SET1(-0x1.ae43dc9bf8ba7p-41));
+    R = V_FMA(R, X2, V_SET1(0x1.6123ce513b09fp-33));
+    R = V_FMA(R, X2, V_SET1(-0x1.ae6454d960ac4p-26));
+    R = V_FMA(R, X2, V_SET1(0x1.71de3a52aab96p-19));
+    R = V_FMA(R, X2, V_SET1(-0x1.a01a01a014eb6p-13));
+    R = V_FMA(R, X2, V_SET1(0x1.11111111110c9p-7));
+    R = V_FMA(R, X2, V_SET1(-0x1.5555555555555p-3));
+    R = V_FMA(R, X2, V_SET1(0x1p0));
+    R = V_MUL(R, X);
+
+    return R;
+}
+#endif
+
+/// @brief Computes the haversine distance of n pairs stored as structure of arrays.
+/// Lanes that don't fill a whole vector go through haversine_distance.
+/// @param x0 Longitude of the first point of each pair
+/// @param y0 Latitude of the first point of each pair
+/// @param x1 Longitude of the second point of each pair
+/// @param y1 Latitude of the second point of each pair
+/// @param out Receives n distances
+/// @param n Number of pairs
+/// @param R Radius of the sphere
+static void haversine_batch(const f64 *x0, const f64 *y0, const f64 *x1, const f64 *y1, f64 *out, size_t n, f64 R)
+{
+    TIME_BANDWIDTH(_s, __func__, n * 4 * sizeof(f64));
+    size_t i = 0;
+#if HAVERSINE_LANES > 1
+    f64 RadC = 0.01745329251994329577;
+    vf64 PosRadC = V_SET1(RadC);
+    vf64 NegRadC = V_SET1(-RadC);
+    vf64 PosHalfRadC = V_SET1(RadC / 2.0);
+    vf64 NegHalfRadC = V_SET1(-(RadC / 2.0));
+    vf64 HalfPi = V_SET1(PI / 2.0);
+    vf64 Pi = V_SET1(PI);
+    vf64 Zero = V_SET1(0.0);
+    vf64 One = V_SET1(1.0);
+    vf64 Half = V_SET1(0.5);
+    vf64 Deg180 = V_SET1(180.0);
+    vf64 AsinC = V_SET1(1.57079632679489661923);
+    vf64 b = V_SET1(2.0 * R);
+
+    for (; i + HAVERSINE_LANES <= n; i += HAVERSINE_LANES)
+    {
+        vf64 lon1 = V_LOAD(x0 + i);
+        vf64 lat1 = V_LOAD(y0 + i);
+        vf64 lon2 = V_LOAD(x1 + i);
+        vf64 lat2 = V_LOAD(y1 + i);
+
+        vf64 SLC1 = V_SELECT(V_LT(lat1, Zero), PosRadC, NegRadC);
+        vf64 SLC2 = V_SELECT(V_LT(lat2, Zero), PosRadC, NegRadC);
+
+        vf64 DLat = V_ABS(V_SUB(lat2, lat1));
+        vf64 DLon = V_ABS(V_SUB(lon2, lon1));
+        vmask LatInRange = V_LT(DLat, Deg180);
+        vmask LonInRange = V_LT(DLon, Deg180);
+        vf64 SLC0 = V_SELECT(LatInRange, PosHalfRadC, NegHalfRadC);
+        vf64 SLC3 = V_SELECT(LonInRange, PosHalfRadC, NegHalfRadC);
+        vf64 ALC0 = V_SELECT(LatInRange, Zero, Pi);
+        vf64 ALC3 = V_SELECT(LonInRange, Zero, Pi);
+
+        vf64 S1 = SineCoreWithPrefix_v(SLC1, lat1, HalfPi);
+        vf64 S2 = SineCoreWithPrefix_v(SLC2, lat2, HalfPi);
+        vf64 S0 = SineCoreWithPrefix_v(SLC0, DLat, ALC0);
+        vf64 S3 = SineCoreWithPrefix_v(SLC3, DLon, ALC3);
+
+        vf64 a = V_FMA(S0, S0, V_MUL(V_MUL(V_MUL(S1, S2), S3), S3));
+
+        vmask NeedsTransform = V_GT(a, Half);
+        vf64 RangeA = V_SELECT(NeedsTransform, V_SUB(One, a), a);
+        vf64 asinR = asin_v(RangeA);
+        vf64 RangeR = V_SELECT(NeedsTransform, V_SUB(AsinC, asinR), asinR);
+
+        V_STORE(out + i, V_MUL(b, RangeR));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        pair_t pair = {
+            .seen = 0,
+            .values = {x0[i], y0[i], x1[i], y1[i]}};
+        out[i] = haversine_distance(&pair, R);
+    }
+    END_SCOPE(_s);
+}
@@ -0,0 +1,404 @@
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+
+// Reduction layer for the haversine distances. Every mode takes values through the same acc_add/acc_add_block
+// calls so the drivers can switch the speed/accuracy tradeoff per run.
+//
+// Plain:    a single running sum, one add per value but a loop carried dependency on the sum
+// Kahan:    compensated single sum, the original behaviour. Also serialized on sum and c, ~4 adds per value
+// Kahan4/8: 4 or 8 independent compensated lanes folded together at the end, same error bound as Kahan but
+//           the lanes don't wait on each other
+// Pairwise: blocks of ACC_PAIRWISE_BLOCK values summed in lanes, then combined as a binary tree, O(log n) error growth
+// Exact:    fixed point superaccumulator covering the whole double range, the sum is exact and rounded once
+typedef enum
+{
+    AccMode_Plain,
+    AccMode_Kahan,
+    AccMode_Kahan4,
+    AccMode_Kahan8,
+    AccMode_Pairwise,
+    AccMode_Exact,
+
+    AccMode_Count,
+} acc_mode;
+
+static const char *acc_mode_names[AccMode_Count] = {"plain", "kahan", "kahan4", "kahan8", "pairwise", "exact"};
+
+#define ACC_MAX_LANES 8
+#define ACC_PAIRWISE_BLOCK 128
+#define ACC_PAIRWISE_LEVELS 64
+
+// 32 bit digits from 2^-1074 (smallest subnormal) up past 2^1024 with room for carries
+#define ACC_EXACT_DIGITS 68
+// Each value adds less than 2^33 to a digit, so digits can't overflow for 2^30 adds. Carries are propagated well before that
+#define ACC_EXACT_NORMALIZE_EVERY (1u << 24)
+
+typedef struct
+{
+    acc_mode mode;
+    size_t count;
+
+    // Plain and Kahan use lane 0, Kahan4/8 use the first 4/8 lanes
+    f64 sum[ACC_MAX_LANES];
+    f64 c[ACC_MAX_LANES];
+    u32 lane; // Kahan4/8: where the next value that doesn't make up a whole round of lanes goes
+
+    // Pairwise: levels[k] holds the sum of 2^k blocks when bit k of level_mask is set
+    f64 block[ACC_PAIRWISE_BLOCK];
+    u32 block_count;
+    u64 level_mask;
+    f64 levels[ACC_PAIRWISE_LEVELS];
+
+    // Exact: value = sum(digits[i] * 2^(32*i - 1074)), inf and nan are kept aside in special
+    s64 digits[ACC_EXACT_DIGITS];
+    u32 pending;
+    f64 special;
+} acc_t;
+
+/// @brief Looks up a mode by its name
+/// @return False if name is not a known mode
+static bool acc_mode_from_name(const char *name, acc_mode *mode)
+{
+    for (u32 i = 0; i < AccMode_Count; ++i)
+    {
+        if (strcmp(name, acc_mode_names[i]) == 0)
+        {
+            *mode = (acc_mode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void acc_init_mode(acc_t *a, acc_mode mode)
+{
+    memset(a, 0, sizeof(*a));
+    a->mode = mode;
+}
+
+// === KAHAN ===
+
+static inline void acc_kahan_add(f64 *sum, f64 *c, f64 value)
+{
+    f64 y = value - *c;
+    f64 t = *sum + y;
+    *c = (t - *sum) - y;
+    *sum = t;
+}
+
+static inline void acc_kahan_lanes(acc_t *a, const f64 *values, size_t n, const u32 lanes)
+{
+    // Locals so the compiler can keep every lane in registers
+    f64 sum[ACC_MAX_LANES], c[ACC_MAX_LANES];
+    for (u32 l = 0; l < lanes; ++l)
+    {
+        sum[l] = a->sum[l];
+        c[l] = a->c[l];
+    }
+
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes)
+    {
+        for (u32 l = 0; l < lanes; ++l)
+            acc_kahan_add(&sum[l], &c[l], values[i + l]);
+    }
+    // The rest goes round robin from where the last call stopped, so values added one at a time through acc_add
+    // still spread over every lane
+    u32 lane = a->lane;
+    for (; i < n; ++i)
+    {
+        acc_kahan_add(&sum[lane], &c[lane], values[i]);
+        lane = (lane + 1 == lanes) ? 0 : lane + 1;
+    }
+    a->lane = lane;
+
+    for (u32 l = 0; l < lanes; ++l)
+    {
+        a->sum[l] = sum[l];
+        a->c[l] = c[l];
+    }
+}
+
+static f64 acc_kahan_total(const acc_t *a, u32 lanes)
+{
+    // Fold the compensated lanes into one compensated sum
+    f64 sum = 0.0, c = 0.0;
+    for (u32 l = 0; l < lanes; ++l)
+    {
+        acc_kahan_add(&sum, &c, a->sum[l]);
+        acc_kahan_add(&sum, &c, -a->c[l]);
+    }
+    return sum;
+}
+
+// === PAIRWISE ===
+
+static f64 acc_pairwise_block(const f64 *values, size_t n)
+{
+    // 8 lanes over the block, then a tree over the lanes
+    f64 lane[8] = {0};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (u32 l = 0; l < 8; ++l)
+            lane[l] += values[i + l];
+    }
+    for (u32 l = 0; i < n; ++i, ++l)
+        lane[l] += values[i];
+
+    return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+
+static void acc_pairwise_push(acc_t *a, f64 value, u32 level)
+{
+    // Binary counter: equal sized partial sums are combined before moving up a level
+    while (level < ACC_PAIRWISE_LEVELS - 1 && (a->level_mask & (1ULL << level)))
+    {
+        value = a->levels[level] + value;
+        a->level_mask &= ~(1ULL << level);
+        level++;
+    }
+    if (a->level_mask & (1ULL << level))
+        value += a->levels[level];
+    a->levels[level] = value;
+    a->level_mask |= 1ULL << level;
+}
+
+static void acc_pairwise_add(acc_t *a, const f64 *values, size_t n)
+{
+    size_t i = 0;
+    // Top up a partially filled block first so whole blocks can come straight from the caller's buffer
+    if (a->block_count)
+    {
+        while (i < n && a->block_count < ACC_PAIRWISE_BLOCK)
+            a->block[a->block_count++] = values[i++];
+        if (a->block_count < ACC_PAIRWISE_BLOCK)
+            return;
+        acc_pairwise_push(a, acc_pairwise_block(a->block, ACC_PAIRWISE_BLOCK), 0);
+        a->block_count = 0;
+    }
+
+    for (; i + ACC_PAIRWISE_BLOCK <= n; i += ACC_PAIRWISE_BLOCK)
+        acc_pairwise_push(a, acc_pairwise_block(values + i, ACC_PAIRWISE_BLOCK), 0);
+    for (; i < n; ++i)
+        a->block[a->block_count++] = values[i];
+}
+
+static f64 acc_pairwise_total(const acc_t *a)
+{
+    // Smallest levels first, the partial block counts as the smallest
+    f64 total = acc_pairwise_block(a->block, a->block_count);
+    for (u32 level = 0; level < ACC_PAIRWISE_LEVELS; ++level)
+    {
+        if (a->level_mask & (1ULL << level))
+            total += a->levels[level];
+    }
+    return total;
+}
+
+// === EXACT ===
+
+static void acc_exact_normalize(s64 *digits)
+{
+    // Leaves every digit but the last in [0, 2^32), the last one carries the sign
+    for (u32 i = 0; i < ACC_EXACT_DIGITS - 1; ++i)
+    {
+        s64 carry = digits[i] >> 32;
+        digits[i] -= carry * ((s64)1 << 32);
+        digits[i + 1] += carry;
+    }
+}
+
+static inline void acc_exact_add(acc_t *a, f64 value)
+{
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    u32 biased_exp = (u32)(bits >> 52) & 0x7FF;
+    u64 mantissa = bits & ((1ULL << 52) - 1);
+    if (biased_exp == 0x7FF)
+    {
+        a->special += value;
+        return;
+    }
+
+    // value = mantissa * 2^(shift - 1074), subnormals share the scale of the smallest normal exponent
+    u32 shift = 0;
+    if (biased_exp != 0)
+    {
+        mantissa |= 1ULL << 52;
+        shift = biased_exp - 1;
+    }
+
+    u32 digit = shift / 32;
+    u32 offset = shift % 32;
+    u64 lo = (mantissa & 0xFFFFFFFF) << offset; // < 2^63
+    u64 hi = (mantissa >> 32) << offset;        // < 2^52
+    s64 sign = (s64)(bits >> 63) ? -1 : 1;
+    a->digits[digit] += sign * (s64)(lo & 0xFFFFFFFF);
+    a->digits[digit + 1] += sign * (s64)((lo >> 32) + (hi & 0xFFFFFFFF));
+    a->digits[digit + 2] += sign * (s64)(hi >> 32);
+
+    if (++a->pending == ACC_EXACT_NORMALIZE_EVERY)
+    {
+        acc_exact_normalize(a->digits);
+        a->pending = 0;
+    }
+}
+
+static f64 acc_exact_total(const acc_t *a)
+{
+    s64 digits[ACC_EXACT_DIGITS];
+    memcpy(digits, a->digits, sizeof(digits));
+    acc_exact_normalize(digits);
+
+    bool negative = digits[ACC_EXACT_DIGITS - 1] < 0;
+    if (negative)
+    {
+        for (u32 i = 0; i < ACC_EXACT_DIGITS; ++i)
+            digits[i] = -digits[i];
+        acc_exact_normalize(digits);
+    }
+
+    int top = ACC_EXACT_DIGITS - 1;
+    while (top >= 0 && digits[top] == 0)
+        top--;
+    if (top < 0)
+        return a->special;
+
+    // Line the leading digit up with bit 63 of a u64, anything below the 64 bits becomes a sticky bit.
+    // That leaves 11 bits under the 53 bit mantissa so the u64 -> f64 conversion is the only rounding step.
+    u64 d0 = (u64)digits[top];
+    u64 d1 = top >= 1 ? (u64)digits[top - 1] : 0;
+    u64 d2 = top >= 2 ? (u64)digits[top - 2] : 0;
+    u32 lz = 0;
+    while (!(d0 & (1ULL << (31 - lz))))
+        lz++;
+
+    u64 top_bits = (d0 << (32 + lz)) | (d1 << lz) | (lz ? (d2 >> (32 - lz)) : 0);
+    bool sticky = (d2 & ((1ULL << (32 - lz)) - 1)) != 0;
+    for (int i = top - 3; i >= 0 && !sticky; --i)
+        sticky = digits[i] != 0;
+    if (sticky)
+        top_bits |= 1;
+
+    // NOTE: results in the subnormal range round twice here, which is irrelevant for distances
+    f64 result = ldexp((f64)top_bits, 32 * (top - 2) + 32 - (int)lz - 1074);
+    return (negative ? -result : result) + a->special;
+}
+
+// === PUBLIC ===
+
+static void acc_add_block(acc_t *a, const f64 *values, size_t n)
+{
+    switch (a->mode)
+    {
+    case AccMode_Plain:
+    {
+        f64 sum = a->sum[0];
+        for (size_t i = 0; i < n; ++i)
+            sum += values[i];
+        a->sum[0] = sum;
+        break;
+    }
+    case AccMode_Kahan:
+        acc_kahan_lanes(a, values, n, 1);
+        break;
+    case AccMode_Kahan4:
+        acc_kahan_lanes(a, values, n, 4);
+        break;
+    case AccMode_Kahan8:
+        acc_kahan_lanes(a, values, n, 8);
+        break;
+    case AccMode_Pairwise:
+        acc_pairwise_add(a, values, n);
+        break;
+    case AccMode_Exact:
+        for (size_t i = 0; i < n; ++i)
+            acc_exact_add(a, values[i]);
+        break;
+    default:
+        break;
+    }
+    a->count += n;
+}
+
+static void acc_add(acc_t *a, f64 value)
+{
+    acc_add_block(a, &value, 1);
+}
+
+static f64 acc_total(const acc_t *a)
+{
+    switch (a->mode)
+    {
+    case AccMode_Plain:
+        return a->sum[0];
+    case AccMode_Kahan:
+        return acc_kahan_total(a, 1);
+    case AccMode_Kahan4:
+        return acc_kahan_total(a, 4);
+    case AccMode_Kahan8:
+        return acc_kahan_total(a, 8);
+    case AccMode_Pairwise:
+        return acc_pairwise_total(a);
+    case AccMode_Exact:
+        return acc_exact_total(a);
+    default:
+        return 0.0;
+    }
+}
+
+static f64 acc_average(const acc_t *a)
+{
+    if (a->count == 0)
+        return 0.0;
+    return acc_total(a) / (f64)a->count;
+}
+
+/// @brief Folds b into a, both must use the same mode. Used to combine per thread accumulators.
+static void acc_merge(acc_t *a, const acc_t *b)
+{
+    size_t count = a->count + b->count;
+    switch (a->mode)
+    {
+    case AccMode_Plain:
+        a->sum[0] += b->sum[0];
+        break;
+    case AccMode_Kahan:
+    case AccMode_Kahan4:
+    case AccMode_Kahan8:
+        // The compensated value of each lane is sum - c
+        for (u32 l = 0; l < ACC_MAX_LANES; ++l)
+        {
+            acc_kahan_add(&a->sum[l], &a->c[l], b->sum[l]);
+            acc_kahan_add(&a->sum[l], &a->c[l], -b->c[l]);
+        }
+        break;
+    case AccMode_Pairwise:
+        acc_pairwise_add(a, b->block, b->block_count);
+        for (u32 level = 0; level < ACC_PAIRWISE_LEVELS; ++level)
+        {
+            if (b->level_mask & (1ULL << level))
+                acc_pairwise_push(a, b->levels[level], level);
+        }
+        break;
+    case AccMode_Exact:
+    {
+        // Normalized digits are below 2^32, so adding two sets can't overflow
+        s64 digits[ACC_EXACT_DIGITS];
+        memcpy(digits, b->digits, sizeof(digits));
+        acc_exact_normalize(digits);
+        acc_exact_normalize(a->digits);
+        for (u32 i = 0; i < ACC_EXACT_DIGITS; ++i)
+            a->digits[i] += digits[i];
+        a->pending = 0;
+        a->special += b->special;
+        break;
+    }
+    default:
+        break;
+    }
+    a->count = count;
+}
@@ -5,7 +5,9 @@
 
 typedef uint64_t u64;
 typedef uint32_t u32;
+typedef int64_t s64;
 typedef double f64;
+typedef float f32;
 typedef unsigned char u8;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define MAX_FRAC 15
+
+// static f64 fast_atof(const char *s, size_t len);
+static const f64 inv_pow10[MAX_FRAC + 1] = {
+    1.0,
+    0.1,
+    0.01,
+    0.001,
+    0.0001,
+    0.00001,
+    0.000001,
+    0.0000001,
+    0.00000001,
+    0.000000001,
+    0.0000000001,
+    0.00000000001,
+    0.000000000001,
+    0.0000000000001,
+    0.00000000000001,
+    0.000000000000001,
+};
+
+static f64 fast_atof(const char *s, size_t len)
+{
+    TIME_FUNCTION(_s);
+    const char *p = s;
+    const char *end = s + len;
+    if (p == end)
+        return 0.0;
+    // sign
+    int sign = 1;
+    if (*p == '-')
+    {
+        sign = -1;
+        ++p;
+    }
+    else if (*p == '+')
+    {
+        ++p;
+    }
+
+    // integer part
+    uint64_t int_part = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        int_part = int_part * 10 + (uint64_t)(*p - '0');
+        ++p;
+    }
+
+    // fraction
+    uint64_t frac_part = 0;
+    int frac_digits = 0;
+    int extra_digit = -1;
+    if (p < end && *p == '.')
+    {
+        ++p;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (frac_digits < MAX_FRAC)
+            {
+                frac_part = frac_part * 10 + (uint64_t)(*p - '0');
+                ++frac_digits;
+            }
+            else if (frac_digits == MAX_FRAC)
+            {
+                extra_digit = *p - '0';
+                frac_digits++;
+            }
+            ++p;
+        }
+    }
+
+    // rounding
+    if (frac_digits > MAX_FRAC && extra_digit >= 0 && extra_digit >= 5)
+    {
+        uint64_t denom = 1;
+        for (int i = 0; i < MAX_FRAC; ++i)
+        {
+            denom *= 10ULL;
+        }
+        frac_part += 1ULL;
+        if (frac_part >= (uint64_t)denom)
+        {
+            frac_part -= (uint64_t)denom;
+            int_part += 1ULL;
+        }
+    }
+
+    // build the value
+    f64 value = (f64)int_part;
+    if (frac_digits > 0)
+    {
+        int used_frac_digits = frac_digits > MAX_FRAC ? MAX_FRAC : frac_digits;
+        value += (f64)frac_part * inv_pow10[used_frac_digits];
+    }
+
+    f64 result = sign < 0 ? -value : value;
+    RETURN_VAL(_s, result);
+    // return result;
+}
+
+// SWAR digit conversion, 8 ascii digits per u64. See "Fast numeric string to int" by Wojciech Mula
+// and fast_float's parse_eight_digits_unrolled.
+static inline bool is_eight_digits(u64 v)
+{
+    return (((v & 0xF0F0F0F0F0F0F0F0) | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333);
+}
+
+static inline u64 parse_eight_digits(u64 v)
+{
+    v -= 0x3030303030303030;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FF) * 0x000F424000000064) + (((v >> 16) & 0x000000FF000000FF) * 0x0000271000000001)) >> 32;
+    return v;
+}
+
+// fast_atof doesn't understand exponents, python writes anything below 1e-4 as e.g. 4.06185373e-06
+static f64 fallback_atof(const char *s, size_t len)
+{
+    if (memchr(s, 'e', len) || memchr(s, 'E', len))
+    {
+        char tmp[64];
+        if (len >= sizeof(tmp))
+            len = sizeof(tmp) - 1;
+        memcpy(tmp, s, len);
+        tmp[len] = '\0';
+        return strtod(tmp, NULL);
+    }
+    return fast_atof(s, len);
+}
+
+/// @brief Fast path for the `-?\d{1,3}\.\d{8,15}` numbers gen_haversine_pairs.py writes. The fraction is converted
+/// 8 digits at a time, everything else goes to fallback_atof. Builds the value the same way fast_atof does, so the
+/// result is bit-for-bit the same as fast_atof for every number without an exponent.
+static f64 fast_atof_swar(const char *s, size_t len)
+{
+    TIME_FUNCTION(_s);
+    const char *p = s;
+    const char *end = s + len;
+    bool negative = (p < end && *p == '-');
+    p += negative;
+
+    u64 int_part = 0;
+    const char *int_end = p + 3 < end ? p + 3 : end;
+    const char *int_start = p;
+    while (p < int_end && *p >= '0' && *p <= '9')
+    {
+        int_part = int_part * 10 + (u64)(*p - '0');
+        ++p;
+    }
+
+    size_t frac_digits = (size_t)(end - p) - 1;
+    if (p == int_start || p >= end || *p != '.' || frac_digits < 8 || frac_digits > MAX_FRAC)
+        RETURN_VAL(_s, fallback_atof(s, len));
+    ++p;
+
+    // The second load ends on the last digit and overlaps the first one, the overlapping
+    // digits are swapped for '0' so it only contributes the digits past the first 8
+    u64 head, tail;
+    memcpy(&head, p, 8);
+    memcpy(&tail, end - 8, 8);
+    u64 overlap_mask = ~0ULL >> (8 * (frac_digits - 8));
+    tail = (tail & ~overlap_mask) | (0x3030303030303030 & overlap_mask);
+    if (!is_eight_digits(head) || !is_eight_digits(tail))
+        RETURN_VAL(_s, fallback_atof(s, len));
+
+    static const u64 pow10[8] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000};
+    u64 frac_part = parse_eight_digits(head) * pow10[frac_digits - 8] + parse_eight_digits(tail);
+
+    f64 value = (f64)int_part + (f64)frac_part * inv_pow10[frac_digits];
+    f64 result = negative ? -value : value;
+    RETURN_VAL(_s, result);
+}
@@ -0,0 +1,384 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#define PROFILER 0
+
+#include "common.h"
+#include "profiler.c"
+#include "_math.c"
+#include "pair_format.c"
+#include "acc.c"
+
+// Native replacement for python/gen_haversine_pairs.py. Writes <prefix>.json, <prefix>.hvb (binary pair format)
+// and <prefix>.answers.f64 (the libm reference distance of every pair followed by their mean).
+//
+// Pairs are generated in fixed size blocks, each block seeded from the seed and its index, so the output only
+// depends on the seed and never on the thread count. Workers format blocks in parallel, the main thread writes
+// them out in order.
+//
+// Coordinates are whole multiples of 10^-GEN_FRAC_DIGITS degrees. With 13 fraction digits the scaled integer
+// stays below 2^53, so value = integer / 10^13 is a single correctly rounded division and matches what strtod
+// makes of the printed text, no need to parse the JSON back for the answers.
+const f64 EARTH_RADIUS_KM = 6372.8;
+
+#define GEN_FRAC_DIGITS 13
+#define GEN_SCALE 10000000000000LL // 10^GEN_FRAC_DIGITS
+#define GEN_BLOCK_PAIRS 65536
+#define GEN_MAX_LINE 128          // longest pair line the JSON writer can produce
+#define GEN_MAX_WORKERS 64
+
+typedef struct
+{
+    u64 seed;
+    u64 pair_count;
+    u32 cluster_count; // 0 for uniform
+} gen_config_t;
+
+typedef struct
+{
+    const gen_config_t *config;
+    u32 index;
+    u32 worker_count;
+
+    HANDLE empty; // signalled when main has written the previous block
+    HANDLE full;  // signalled when block is ready
+
+    // Current block
+    u64 first_pair;
+    u32 count;
+    char *json;
+    size_t json_len;
+    f64 *values; // x0, y0, x1, y1 interleaved
+    f64 *answers;
+    acc_t sum;
+} gen_worker_t;
+
+// === RANDOM ===
+
+static u64 splitmix64(u64 *state)
+{
+    u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/// @brief Uniform integer in [lo, hi]
+static s64 random_range(u64 *state, s64 lo, s64 hi)
+{
+    // The modulo bias is under 2^-40 for these ranges
+    return lo + (s64)(splitmix64(state) % (u64)(hi - lo + 1));
+}
+
+// === COORDINATES ===
+// Longitudes in [-180, 180] and latitudes in [-90, 90], both in units of 10^-13 degrees
+
+#define GEN_LON_MAX (180 * GEN_SCALE)
+#define GEN_LAT_MAX (90 * GEN_SCALE)
+
+typedef struct
+{
+    s64 x, y;
+    s64 radius_x, radius_y;
+} gen_cluster_t;
+
+static gen_cluster_t cluster_for_pair(const gen_config_t *config, u64 pair_index)
+{
+    // Clusters own contiguous runs of pairs, which is the locality the clustered mode is after
+    u64 cluster = pair_index * config->cluster_count / config->pair_count;
+    u64 state = config->seed ^ (0xC1057E2ULL + cluster * 0x9E3779B97F4A7C15ULL);
+
+    gen_cluster_t c;
+    c.x = random_range(&state, -GEN_LON_MAX, GEN_LON_MAX);
+    c.y = random_range(&state, -GEN_LAT_MAX, GEN_LAT_MAX);
+    c.radius_x = random_range(&state, 1 * GEN_SCALE, 30 * GEN_SCALE);
+    c.radius_y = random_range(&state, 1 * GEN_SCALE, 15 * GEN_SCALE);
+    return c;
+}
+
+static s64 wrap_longitude(s64 x)
+{
+    if (x > GEN_LON_MAX)
+        x -= 2 * GEN_LON_MAX;
+    else if (x < -GEN_LON_MAX)
+        x += 2 * GEN_LON_MAX;
+    return x;
+}
+
+static s64 clamp_latitude(s64 y)
+{
+    return y > GEN_LAT_MAX ? GEN_LAT_MAX : (y < -GEN_LAT_MAX ? -GEN_LAT_MAX : y);
+}
+
+/// @brief Writes a fixed point coordinate as -?\d{1,3}\.\d{13}
+/// @return Number of characters written
+static size_t format_coordinate(char *out, s64 value)
+{
+    char *at = out;
+    u64 magnitude = (u64)value;
+    if (value < 0)
+    {
+        *at++ = '-';
+        magnitude = (u64)(-value);
+    }
+
+    u64 whole = magnitude / GEN_SCALE;
+    u64 frac = magnitude % GEN_SCALE;
+    if (whole >= 100)
+        *at++ = (char)('0' + whole / 100);
+    if (whole >= 10)
+        *at++ = (char)('0' + (whole / 10) % 10);
+    *at++ = (char)('0' + whole % 10);
+    *at++ = '.';
+    for (int i = GEN_FRAC_DIGITS - 1; i >= 0; --i)
+    {
+        at[i] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    at += GEN_FRAC_DIGITS;
+    return (size_t)(at - out);
+}
+
+static size_t append_text(char *out, const char *text)
+{
+    size_t len = strlen(text);
+    memcpy(out, text, len);
+    return len;
+}
+
+// === WORKERS ===
+
+static void generate_block(gen_worker_t *w)
+{
+    const gen_config_t *config = w->config;
+    u64 state = config->seed ^ ((w->first_pair / GEN_BLOCK_PAIRS + 1) * 0xD1B54A32D192ED03ULL);
+    static const char *keys[4] = {"{\"x0\": ", ", \"y0\": ", ", \"x1\": ", ", \"y1\": "};
+
+    char *out = w->json;
+    acc_init_mode(&w->sum, AccMode_Exact);
+    for (u32 i = 0; i < w->count; ++i)
+    {
+        u64 pair_index = w->first_pair + i;
+        s64 fixed[4];
+        if (config->cluster_count)
+        {
+            gen_cluster_t c = cluster_for_pair(config, pair_index);
+            for (u32 p = 0; p < 4; p += 2)
+            {
+                fixed[p] = wrap_longitude(c.x + random_range(&state, -c.radius_x, c.radius_x));
+                fixed[p + 1] = clamp_latitude(c.y + random_range(&state, -c.radius_y, c.radius_y));
+            }
+        }
+        else
+        {
+            for (u32 p = 0; p < 4; p += 2)
+            {
+                fixed[p] = random_range(&state, -GEN_LON_MAX, GEN_LON_MAX);
+                fixed[p + 1] = random_range(&state, -GEN_LAT_MAX, GEN_LAT_MAX);
+            }
+        }
+
+        f64 *v = w->values + (size_t)i * 4;
+        *out++ = '\t';
+        for (u32 p = 0; p < 4; ++p)
+        {
+            v[p] = (f64)fixed[p] / (f64)GEN_SCALE;
+            out += append_text(out, keys[p]);
+            out += format_coordinate(out, fixed[p]);
+        }
+        out += append_text(out, (pair_index + 1 < config->pair_count) ? "},\n" : "}\n");
+
+        w->answers[i] = reference_haversine(v[0], v[1], v[2], v[3], EARTH_RADIUS_KM);
+    }
+    acc_add_block(&w->sum, w->answers, w->count);
+    w->json_len = (size_t)(out - w->json);
+}
+
+static DWORD WINAPI gen_worker_thread(LPVOID param)
+{
+    gen_worker_t *w = param;
+    const gen_config_t *config = w->config;
+    u64 block_count = (config->pair_count + GEN_BLOCK_PAIRS - 1) / GEN_BLOCK_PAIRS;
+    for (u64 block = w->index; block < block_count; block += w->worker_count)
+    {
+        WaitForSingleObject(w->empty, INFINITE);
+        w->first_pair = block * GEN_BLOCK_PAIRS;
+        u64 remaining = config->pair_count - w->first_pair;
+        w->count = (u32)(remaining < GEN_BLOCK_PAIRS ? remaining : GEN_BLOCK_PAIRS);
+        generate_block(w);
+        ReleaseSemaphore(w->full, 1, NULL);
+    }
+    return 0;
+}
+
+// === DRIVER ===
+
+typedef struct
+{
+    FILE *json;
+    FILE *answers;
+    pair_writer_t binary;
+    acc_t sum;
+} gen_output_t;
+
+static bool write_block(gen_output_t *out, const gen_worker_t *w)
+{
+    bool ok = fwrite(w->json, 1, w->json_len, out->json) == w->json_len &&
+              fwrite(w->answers, sizeof(f64), w->count, out->answers) == w->count;
+    for (u32 i = 0; ok && i < w->count; ++i)
+    {
+        const f64 *v = w->values + (size_t)i * 4;
+        ok = pair_writer_add(&out->binary, v[0], v[1], v[2], v[3]);
+    }
+    acc_merge(&out->sum, &w->sum);
+    return ok;
+}
+
+static bool generate(const gen_config_t *config, u32 worker_count, const char *prefix)
+{
+    char path[1024];
+    static gen_output_t out;
+    acc_init_mode(&out.sum, AccMode_Exact);
+
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    out.json = fopen(path, "wb");
+    snprintf(path, sizeof(path), "%s.answers.f64", prefix);
+    out.answers = fopen(path, "wb");
+    snprintf(path, sizeof(path), "%s.hvb", prefix);
+    bool binary_open = pair_writer_open(&out.binary, path, PairLayout_AoS, PairType_F64, PAIR_CHUNK_DEFAULT);
+    if (!out.json || !out.answers || !binary_open)
+    {
+        fprintf(stderr, "Unable to create the output files for %s\n", prefix);
+        return false;
+    }
+
+    static gen_worker_t workers[GEN_MAX_WORKERS];
+    HANDLE handles[GEN_MAX_WORKERS];
+    for (u32 i = 0; i < worker_count; ++i)
+    {
+        gen_worker_t *w = &workers[i];
+        w->config = config;
+        w->index = i;
+        w->worker_count = worker_count;
+        w->empty = CreateSemaphore(NULL, 1, 1, NULL);
+        w->full = CreateSemaphore(NULL, 0, 1, NULL);
+        w->json = malloc((size_t)GEN_BLOCK_PAIRS * GEN_MAX_LINE);
+        w->values = malloc((size_t)GEN_BLOCK_PAIRS * 4 * sizeof(f64));
+        w->answers = malloc((size_t)GEN_BLOCK_PAIRS * sizeof(f64));
+        if (!w->json || !w->values || !w->answers)
+        {
+            fprintf(stderr, "Unable to allocate generator buffers\n");
+            return false;
+        }
+    }
+    for (u32 i = 0; i < worker_count; ++i)
+        handles[i] = CreateThread(NULL, 0, gen_worker_thread, &workers[i], 0, NULL);
+
+    const char *json_header = "{\"pairs\": [\n";
+    bool ok = fwrite(json_header, 1, strlen(json_header), out.json) == strlen(json_header);
+
+    // Block b is always made by worker b % worker_count, so waiting on the workers in turn writes blocks in order
+    u64 block_count = (config->pair_count + GEN_BLOCK_PAIRS - 1) / GEN_BLOCK_PAIRS;
+    for (u64 block = 0; block < block_count; ++block)
+    {
+        gen_worker_t *w = &workers[block % worker_count];
+        WaitForSingleObject(w->full, INFINITE);
+        if (ok)
+            ok = write_block(&out, w);
+        ReleaseSemaphore(w->empty, 1, NULL);
+    }
+    WaitForMultipleObjects(worker_count, handles, TRUE, INFINITE);
+
+    f64 mean = config->pair_count ? acc_average(&out.sum) : NAN;
+    const char *json_footer = "]}";
+    ok = ok && fwrite(json_footer, 1, strlen(json_footer), out.json) == strlen(json_footer);
+    ok = ok && fwrite(&mean, sizeof(mean), 1, out.answers) == 1;
+    ok = pair_writer_close(&out.binary, mean) && ok;
+    ok = (fclose(out.json) == 0) && ok;
+    ok = (fclose(out.answers) == 0) && ok;
+
+    for (u32 i = 0; i < worker_count; ++i)
+    {
+        CloseHandle(handles[i]);
+        CloseHandle(workers[i].empty);
+        CloseHandle(workers[i].full);
+        free(workers[i].json);
+        free(workers[i].values);
+        free(workers[i].answers);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing the output files for %s\n", prefix);
+        return false;
+    }
+
+    printf("Pairs: %llu, seed %llu, %s", (unsigned long long)config->pair_count, (unsigned long long)config->seed,
+           config->cluster_count ? "clustered" : "uniform");
+    if (config->cluster_count)
+        printf(" (%u clusters)", config->cluster_count);
+    printf("\nExpected mean: %.16f\n", mean);
+    return true;
+}
+
+static void usage(const char *exe)
+{
+    fprintf(stderr, "Usage: %s [-s seed] [-t threads] [-c clusters] [-o prefix] pair_count\n", exe);
+    fprintf(stderr, "  -s seed      random seed, default 1\n");
+    fprintf(stderr, "  -t threads   generator threads, default every core\n");
+    fprintf(stderr, "  -c clusters  clustered mode with N clusters, 0 for uniform (default)\n");
+    fprintf(stderr, "  -o prefix    output path prefix, default data_<pair_count>\n");
+    fprintf(stderr, "Writes <prefix>.json, <prefix>.hvb and <prefix>.answers.f64\n");
+}
+
+int main(int argc, char *argv[])
+{
+    gen_config_t config = {.seed = 1};
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    u32 worker_count = (u32)info.dwNumberOfProcessors;
+    const char *prefix = NULL;
+    const char *count_text = NULL;
+    u32 arg_count = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            config.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            worker_count = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            config.cluster_count = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            prefix = argv[++i];
+        else
+            count_text = argv[i], arg_count++;
+    }
+
+    if (arg_count != 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    config.pair_count = strtoull(count_text, NULL, 10);
+    if (worker_count == 0)
+        worker_count = 1;
+    if (worker_count > GEN_MAX_WORKERS)
+        worker_count = GEN_MAX_WORKERS;
+    if (config.cluster_count > config.pair_count)
+        config.cluster_count = (u32)config.pair_count;
+
+    char default_prefix[64];
+    if (!prefix)
+    {
+        snprintf(default_prefix, sizeof(default_prefix), "data_%llu", (unsigned long long)config.pair_count);
+        prefix = default_prefix;
+    }
+
+    return generate(&config, worker_count, prefix) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,139 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#define PROFILER 0
+
+#include "common.h"
+#include "profiler.c"
+#include "_math.c"
+#include "../sax_json/sax_json.c"
+#include "fast_atof.c"
+#include "pair_format.c"
+#include "acc.c"
+
+// Converts a {"pairs": [{"x0":..,"y0":..,"x1":..,"y1":..}, ...]} file into the binary pair format.
+// Same schema assumptions as main.c, the keys are expected in x0, y0, x1, y1 order.
+const f64 EARTH_RADIUS_KM = 6372.8;
+
+typedef struct
+{
+    pair_writer_t writer;
+    f64 values[4];
+    unsigned seen;
+    bool write_failed;
+
+    // Exact sum of the libm reference distances, stored as the file's reference mean
+    acc_t ref;
+} json2bin_t;
+
+void on_number(void *ud, const char *num_text, size_t len)
+{
+    json2bin_t *j = ud;
+    if (j->seen < 4)
+        j->values[j->seen] = fast_atof_swar(num_text, len);
+    j->seen++;
+}
+
+void on_end_object(void *ud)
+{
+    json2bin_t *j = ud;
+    if (j->seen == 0)
+        return;
+
+    if (j->seen != 4)
+    {
+        fprintf(stderr, "Skipping object with %u numbers, expected 4\n", j->seen);
+        j->seen = 0;
+        return;
+    }
+
+    f64 *v = j->values;
+    if (!pair_writer_add(&j->writer, v[0], v[1], v[2], v[3]))
+        j->write_failed = true;
+
+    acc_add(&j->ref, reference_haversine(v[0], v[1], v[2], v[3], EARTH_RADIUS_KM));
+    j->seen = 0;
+}
+
+void on_error(void *ud, const char *msg, size_t pos)
+{
+    (void)ud;
+    fprintf(stderr, "Parser error at byte %zu: %s\n", pos, msg);
+}
+
+static void usage(const char *exe)
+{
+    fprintf(stderr, "Usage: %s [--soa] [--f32] [--chunk pairs] input.json output.bin\n", exe);
+    fprintf(stderr, "  --soa          store each chunk as x0[], y0[], x1[], y1[] columns (default interleaved pairs)\n");
+    fprintf(stderr, "  --f32          store float32 instead of float64\n");
+    fprintf(stderr, "  --chunk pairs  pairs per chunk, default %d\n", PAIR_CHUNK_DEFAULT);
+}
+
+int main(int argc, char *argv[])
+{
+    begin_profile();
+    pair_layout layout = PairLayout_AoS;
+    pair_type element_type = PairType_F64;
+    u32 chunk_pairs = PAIR_CHUNK_DEFAULT;
+    const char *paths[2] = {NULL, NULL};
+    u32 path_count = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--soa") == 0)
+            layout = PairLayout_SoA;
+        else if (strcmp(argv[i], "--f32") == 0)
+            element_type = PairType_F32;
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+            chunk_pairs = (u32)strtoul(argv[++i], NULL, 10);
+        else if (path_count < 2)
+            paths[path_count++] = argv[i];
+        else
+            path_count = 3;
+    }
+
+    if (path_count != 2 || chunk_pairs == 0 || chunk_pairs > PAIR_CHUNK_MAX)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static json2bin_t j;
+    acc_init_mode(&j.ref, AccMode_Exact);
+    if (!pair_writer_open(&j.writer, paths[1], layout, element_type, chunk_pairs))
+    {
+        fprintf(stderr, "Unable to create %s\n", paths[1]);
+        return 1;
+    }
+
+    // Only the pairs array is parsed, anything next to it is skipped
+    static const char *const pair_paths[] = {"pairs"};
+    json_sax_handler_t h = {
+        .error = on_error,
+        .end_object = on_end_object,
+        .number = on_number,
+        .paths = pair_paths,
+        .path_count = 1};
+
+    bool ok = parse_mapped_with_sax(paths[0], &h, &j);
+    u64 pair_count = j.writer.header.PairCount + j.writer.count;
+    f64 ref_mean = pair_count ? acc_average(&j.ref) : NAN;
+    if (!pair_writer_close(&j.writer, ref_mean) || j.write_failed)
+    {
+        fprintf(stderr, "Error writing %s\n", paths[1]);
+        ok = false;
+    }
+
+    // The header of a half converted file would still check out, so don't leave one behind
+    if (!ok && remove(paths[1]) != 0)
+        fprintf(stderr, "Unable to remove %s\n", paths[1]);
+
+    end_and_print_profile();
+    printf("Pairs: %llu, reference mean %.16f\n", (unsigned long long)pair_count, ref_mean);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -15,205 +15,510 @@
 #include "common.h"
 #include "profiler.c"
 #include "_math.c"
-#include "sax_json.c"
+#include "../sax_json/sax_json.c"
+#include "fast_atof.c"
+#include "acc.c"
 
-#define MAX_FRAC 15
 const f64 EARTH_RADIUS_KM = 6372.8;
 
-// static f64 fast_atof(const char *s, size_t len);
-static const f64 inv_pow10[MAX_FRAC + 1] = {
-    1.0,
-    0.1,
-    0.01,
-    0.001,
-    0.0001,
-    0.00001,
-    0.000001,
-    0.0000001,
-    0.00000001,
-    0.000000001,
-    0.0000000001,
-    0.00000000001,
-    0.000000000001,
-    0.0000000000001,
-    0.00000000000001,
-    0.000000000000001,
-};
-
-static f64 fast_atof(const char *s, size_t len)
-{
-    TIME_FUNCTION(_s);
-    const char *p = s;
-    const char *end = s + len;
-    if (p == end)
-        return 0.0;
-    // sign
-    int sign = 1;
-    if (*p == '-')
-    {
-        sign = -1;
-        ++p;
-    }
-    else if (*p == '+')
-    {
-        ++p;
-    }
+f64 basic_acc = 0.0;
 
-    // integer part
-    uint64_t int_part = 0;
-    while (p < end && *p >= '0' && *p <= '9')
-    {
-        int_part = int_part * 10 + (uint64_t)(*p - '0');
-        ++p;
-    }
+// Parsed pairs are staged as structure of arrays and flushed through haversine_batch a block at a time,
+// so parsing and the math each get their own hot loop (and their own profile anchor)
+#ifndef STAGE_PAIRS
+#define STAGE_PAIRS 4096
+#endif
 
-    // fraction
-    uint64_t frac_part = 0;
-    int frac_digits = 0;
-    int extra_digit = -1;
-    if (p < end && *p == '.')
-    {
-        ++p;
-        while (p < end && *p >= '0' && *p <= '9')
-        {
-            if (frac_digits < MAX_FRAC)
-            {
-                frac_part = frac_part * 10 + (uint64_t)(*p - '0');
-                ++frac_digits;
-            }
-            else if (frac_digits == MAX_FRAC)
-            {
-                extra_digit = *p - '0';
-                frac_digits++;
-            }
-            ++p;
-        }
-    }
+typedef struct
+{
+    // x0, y0, x1, y1 columns, in the order the keys appear in each object
+    f64 columns[4][STAGE_PAIRS];
+    f64 distances[STAGE_PAIRS];
+    size_t count;
+} stage_t;
 
-    // rounding
-    if (frac_digits > MAX_FRAC && extra_digit >= 0 && extra_digit >= 5)
-    {
-        uint64_t denom = 1;
-        for (int i = 0; i < MAX_FRAC; ++i)
-        {
-            denom *= 10ULL;
-        }
-        frac_part += 1ULL;
-        if (frac_part >= (uint64_t)denom)
-        {
-            frac_part -= (uint64_t)denom;
-            int_part += 1ULL;
-        }
-    }
+// === DISTANCE VALIDATION ===
+// With --validate every distance out of haversine_batch is checked against reference_haversine (libm sin/cos/asin).
+// The custom math stays vectorized, only the reference is scalar, and each worker keeps its own stats.
+#define VALIDATE_BUCKETS 18 // 0, 1, 2, 3-4, 5-8, ..., over 2^15 ulp
 
-    // build the value
-    f64 value = (f64)int_part;
-    if (frac_digits > 0)
-    {
-        int used_frac_digits = frac_digits > MAX_FRAC ? MAX_FRAC : frac_digits;
-        value += (f64)frac_part * inv_pow10[used_frac_digits];
-    }
+typedef struct
+{
+    u64 count;
+    u64 max_ulp;
+    u64 total_ulp;
+    f64 max_abs_error;
+    f64 worst[4]; // x0, y0, x1, y1 of the pair with the largest ulp error
+    u64 histogram[VALIDATE_BUCKETS];
+    acc_t reference; // exact sum of the reference distances
+} validate_t;
 
-    f64 result = sign < 0 ? -value : value;
-    RETURN_VAL(_s, result);
-    // return result;
+static u64 ulp_distance(f64 a, f64 b)
+{
+    // Map the sign-magnitude bit patterns onto a line where adjacent doubles are adjacent integers
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    if (ia < 0)
+        ia = INT64_MIN - ia;
+    if (ib < 0)
+        ib = INT64_MIN - ib;
+    return ia > ib ? (u64)ia - (u64)ib : (u64)ib - (u64)ia;
 }
 
-typedef struct
+static u32 ulp_bucket(u64 ulp)
 {
-    f64 sum;
-    f64 c;
-    size_t count;
-} acc_t;
+    if (ulp == 0)
+        return 0;
 
-f64 basic_acc = 0.0;
+    // 1 + ceil(log2(ulp))
+    u32 bucket = 1;
+    for (u64 limit = 1; limit < ulp && bucket < VALIDATE_BUCKETS - 1; limit <<= 1)
+        bucket++;
+    return bucket;
+}
 
-static void acc_init(acc_t *a)
+static void validate_init(validate_t *v)
 {
-    a->sum = 0.0;
-    a->c = 0.0;
-    a->count = 0;
+    memset(v, 0, sizeof(*v));
+    acc_init_mode(&v->reference, AccMode_Exact);
+}
+
+static void validate_pairs(validate_t *v, const f64 *x0, const f64 *y0, const f64 *x1, const f64 *y1,
+                           const f64 *distances, size_t n)
+{
+    TIME_FUNCTION(_s);
+    for (size_t i = 0; i < n; ++i)
+    {
+        f64 ref = reference_haversine(x0[i], y0[i], x1[i], y1[i], EARTH_RADIUS_KM);
+        u64 ulp = ulp_distance(distances[i], ref);
+        f64 abs_error = fabs(distances[i] - ref);
+
+        v->total_ulp += ulp;
+        v->histogram[ulp_bucket(ulp)]++;
+        if (abs_error > v->max_abs_error)
+            v->max_abs_error = abs_error;
+        if (ulp > v->max_ulp)
+        {
+            v->max_ulp = ulp;
+            v->worst[0] = x0[i];
+            v->worst[1] = y0[i];
+            v->worst[2] = x1[i];
+            v->worst[3] = y1[i];
+        }
+        acc_add(&v->reference, ref);
+    }
+    v->count += n;
+    END_SCOPE(_s);
 }
 
-static void acc_add(acc_t *a, f64 value)
+static void validate_merge(validate_t *a, const validate_t *b)
 {
-    // Kahan add
-    f64 y = value - a->c;
-    f64 t = a->sum + y;
-    a->c = (t - a->sum) - y;
-    a->sum = t;
-    a->count++;
+    a->count += b->count;
+    a->total_ulp += b->total_ulp;
+    if (b->max_abs_error > a->max_abs_error)
+        a->max_abs_error = b->max_abs_error;
+    if (b->max_ulp > a->max_ulp)
+    {
+        a->max_ulp = b->max_ulp;
+        memcpy(a->worst, b->worst, sizeof(a->worst));
+    }
+    for (u32 i = 0; i < VALIDATE_BUCKETS; ++i)
+        a->histogram[i] += b->histogram[i];
+    acc_merge(&a->reference, &b->reference);
 }
 
-static f64 acc_average(const acc_t *a)
+static void print_validation(const validate_t *v, f64 avg)
 {
-    if (a->count == 0)
-        return 0.0;
-    return a->sum / (f64)a->count;
+    f64 n = v->count ? (f64)v->count : 1.0;
+    f64 ref_avg = acc_average(&v->reference);
+    printf("Validated %llu pairs against libm\n", (unsigned long long)v->count);
+    printf("  max abs error %.3e km, max error %llu ulp at (%.16f, %.16f, %.16f, %.16f)\n", v->max_abs_error,
+           (unsigned long long)v->max_ulp, v->worst[0], v->worst[1], v->worst[2], v->worst[3]);
+    printf("  mean error %.6f ulp\n", (f64)v->total_ulp / n);
+    printf("  reference mean %.16f, error: %.15f\n", ref_avg, ref_avg - avg);
+    for (u32 i = 0; i < VALIDATE_BUCKETS; ++i)
+    {
+        if (!v->histogram[i])
+            continue;
+
+        char label[32];
+        if (i <= 2)
+            snprintf(label, sizeof(label), "%u", i);
+        else if (i == VALIDATE_BUCKETS - 1)
+            snprintf(label, sizeof(label), "> %llu", 1ULL << (i - 2));
+        else
+            snprintf(label, sizeof(label), "%llu-%llu", (1ULL << (i - 2)) + 1, 1ULL << (i - 1));
+        printf("  %12s ulp: %llu (%.4f%%)\n", label, (unsigned long long)v->histogram[i], 100.0 * (f64)v->histogram[i] / n);
+    }
 }
 
 typedef struct
 {
-    pair_t current;
+    stage_t stage;
+    unsigned seen;
     acc_t acc;
+    bool validate;
+    validate_t check;
 } handler_ud_t;
 
+static void stage_flush(handler_ud_t *h)
+{
+    TIME_BANDWIDTH(_s, __func__, h->stage.count * 4 * sizeof(f64));
+    stage_t *stage = &h->stage;
+    haversine_batch(stage->columns[0], stage->columns[1], stage->columns[2], stage->columns[3],
+                    stage->distances, stage->count, EARTH_RADIUS_KM);
+    acc_add_block(&h->acc, stage->distances, stage->count);
+    if (h->validate)
+        validate_pairs(&h->check, stage->columns[0], stage->columns[1], stage->columns[2], stage->columns[3],
+                       stage->distances, stage->count);
+    stage->count = 0;
+    END_SCOPE(_s);
+}
+
 void on_number(void *ud, const char *num_text, size_t len)
 {
     TIME_FUNCTION(_s);
     handler_ud_t *h = ud;
-    f64 v = fast_atof(num_text, len);
-    h->current.values[h->current.seen++] = v;
+    f64 v = fast_atof_swar(num_text, len);
+    if (h->seen < 4)
+        h->stage.columns[h->seen][h->stage.count] = v;
+    h->seen++;
     END_SCOPE(_s);
 }
 
 void on_end_object(void *ud)
 {
-    TIME_BANDWIDTH(_s, __func__, sizeof(pair_t) + sizeof(f64));
+    TIME_FUNCTION(_s);
     handler_ud_t *h = ud;
 
-    if (h->current.seen > 0)
+    if (h->seen == 4)
     {
-        f64 val = haversine_distance(&h->current, EARTH_RADIUS_KM);
-        acc_add(&h->acc, val);
-        // basic_acc += val;
-        h->current.seen = 0;
+        if (++h->stage.count == STAGE_PAIRS)
+            stage_flush(h);
     }
+    else if (h->seen > 0)
+    {
+        fprintf(stderr, "Skipping object with %u numbers, expected 4\n", h->seen);
+    }
+    h->seen = 0;
 
-    // Blank current for next object
-    // memset(&h->current, 0, sizeof(h->current));
     RETURN_VOID(_s);
 }
 
+// Fast path for objects that match pair_shape exactly, the engine parses the numbers and hands over the whole pair
+void on_record(void *ud, const double *values)
+{
+    TIME_FUNCTION(_s);
+    handler_ud_t *h = ud;
+    for (u32 c = 0; c < 4; ++c)
+        h->stage.columns[c][h->stage.count] = values[c];
+    if (++h->stage.count == STAGE_PAIRS)
+        stage_flush(h);
+    END_SCOPE(_s);
+}
+
+static const json_record_shape_t pair_shape = {
+    .keys = {"x0", "y0", "x1", "y1"},
+    .field_count = 4,
+    .parse_number = fast_atof_swar,
+    .record = on_record};
+
+// Cleared by --generic to time the plain state machine
+static const json_record_shape_t *record_shape = &pair_shape;
+
+// Batched alternative to the handlers above for --tape. The events come a few thousand at a time with the numbers
+// already converted (exactly, by the engine), so the staging is one loop over the tape.
+void on_batch(void *ud, const json_tape_event_t *events, size_t count)
+{
+    TIME_FUNCTION(_s);
+    handler_ud_t *h = ud;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const json_tape_event_t *e = &events[i];
+        if (e->type == JSON_EVENT_NUMBER)
+        {
+            if (h->seen < 4)
+                h->stage.columns[h->seen][h->stage.count] = e->number;
+            h->seen++;
+        }
+        else if (e->type == JSON_EVENT_END_OBJECT)
+        {
+            if (h->seen == 4)
+            {
+                if (++h->stage.count == STAGE_PAIRS)
+                    stage_flush(h);
+            }
+            else if (h->seen > 0)
+            {
+                fprintf(stderr, "Skipping object with %u numbers, expected 4\n", h->seen);
+            }
+            h->seen = 0;
+        }
+    }
+    END_SCOPE(_s);
+}
+
+// Set by --tape
+static void (*batch_fn)(void *ud, const json_tape_event_t *events, size_t count) = NULL;
+
+// Only the pairs array is parsed, anything next to it (metadata and such) is skipped
+static const char *const pair_paths[] = {"pairs"};
+
+// The engine with the handlers above compiled in, pairs_process_chunk calls them directly
+#define JSON_SAX_PREFIX pairs_
+#define JSON_SAX_STATIC
+#define JSON_SAX_ON_END_OBJECT on_end_object
+#define JSON_SAX_ON_NUMBER on_number
+#define JSON_SAX_ON_RECORD on_record
+#define JSON_SAX_PARSE_NUMBER fast_atof_swar
+#include "../sax_json/sax_json_engine.h"
+
+// Switched to process_chunk by --dynamic to time the function pointer handlers
+static json_chunk_fn chunk_fn = pairs_process_chunk;
+
 void on_error(void *ud, const char *msg, size_t pos)
 {
     (void)ud;
     fprintf(stderr, "Parser error at byte %zu: %s\n", pos, msg);
 }
 
+// === NUMBER PARSER CHECK ===
+// Compares fast_atof_swar, fast_atof and the engine's json_atof against strtod for every number in the file
+typedef struct
+{
+    u64 count;
+    u64 swar_exact;
+    u64 atof_exact;
+    u64 swar_max_ulp;
+    u64 atof_max_ulp;
+    u64 swar_total_ulp;
+    u64 atof_total_ulp;
+    u64 json_exact;
+    u64 json_max_ulp;
+    u64 json_total_ulp;
+} atof_check_t;
+
+void on_number_check(void *ud, const char *num_text, size_t len)
+{
+    atof_check_t *c = ud;
+    char tmp[64];
+    if (len >= sizeof(tmp))
+        len = sizeof(tmp) - 1;
+    memcpy(tmp, num_text, len);
+    tmp[len] = '\0';
+
+    f64 ref = strtod(tmp, NULL);
+    u64 swar_ulp = ulp_distance(fast_atof_swar(num_text, len), ref);
+    u64 atof_ulp = ulp_distance(fast_atof(num_text, len), ref);
+    u64 json_ulp = ulp_distance(json_atof(num_text, len), ref);
+
+    c->count++;
+    c->swar_exact += (swar_ulp == 0);
+    c->atof_exact += (atof_ulp == 0);
+    c->swar_total_ulp += swar_ulp;
+    c->atof_total_ulp += atof_ulp;
+    if (swar_ulp > c->swar_max_ulp)
+        c->swar_max_ulp = swar_ulp;
+    if (atof_ulp > c->atof_max_ulp)
+        c->atof_max_ulp = atof_ulp;
+    c->json_exact += (json_ulp == 0);
+    c->json_total_ulp += json_ulp;
+    if (json_ulp > c->json_max_ulp)
+        c->json_max_ulp = json_ulp;
+}
+
+static void print_atof_check(const char *label, u64 count, u64 exact, u64 max_ulp, u64 total_ulp)
+{
+    f64 n = count ? (f64)count : 1.0;
+    printf("  %-16s exact %llu (%.4f%%), max error %llu ulp, mean error %.6f ulp\n", label,
+           (unsigned long long)exact, 100.0 * (f64)exact / n, (unsigned long long)max_ulp, (f64)total_ulp / n);
+}
+
+static bool check_atof(const char *path)
+{
+    json_sax_handler_t h = {
+        .error = on_error,
+        .number = on_number_check};
+
+    atof_check_t check;
+    memset(&check, 0, sizeof(check));
+    if (!parse_file_with_sax(path, &h, &check))
+        return false;
+
+    printf("Numbers compared against strtod: %llu\n", (unsigned long long)check.count);
+    print_atof_check("fast_atof_swar", check.count, check.swar_exact, check.swar_max_ulp, check.swar_total_ulp);
+    print_atof_check("fast_atof", check.count, check.atof_exact, check.atof_max_ulp, check.atof_total_ulp);
+    print_atof_check("json_atof", check.count, check.json_exact, check.json_max_ulp, check.json_total_ulp);
+    return true;
+}
+
+// === PARALLEL DRIVER ===
+// parse_file_parallel_with cuts the "pairs" array into one run of pairs per worker, each parsed by the pairs_
+// engine into its own handler_ud_t. The workers are merged in order, so the pairs reach the result in file order.
+#define MAX_WORKERS 64
+
+/// @param result Filled with the merged accumulator (and validation stats), its acc mode and validate flag are used for every worker
+static bool parse_pairs_parallel(const char *path, u32 worker_count, handler_ud_t *result)
+{
+    json_sax_handler_t h = {
+        .error = on_error,
+        .end_object = on_end_object,
+        .number = on_number,
+        .record_shape = record_shape,
+        .paths = pair_paths,
+        .path_count = 1,
+        .on_batch = batch_fn};
+
+    handler_ud_t *workers = calloc(worker_count, sizeof(handler_ud_t));
+    if (!workers)
+    {
+        fprintf(stderr, "Unable to allocate parallel parser state\n");
+        return false;
+    }
+
+    void *worker_ud[MAX_WORKERS];
+    for (u32 i = 0; i < worker_count; ++i)
+    {
+        acc_init_mode(&workers[i].acc, result->acc.mode);
+        workers[i].validate = result->validate;
+        validate_init(&workers[i].check);
+        worker_ud[i] = &workers[i];
+    }
+
+    bool ok = parse_file_parallel_with(path, chunk_fn, &h, "pairs", worker_ud, worker_count);
+
+    acc_init_mode(&result->acc, result->acc.mode);
+    validate_init(&result->check);
+    for (u32 i = 0; i < worker_count; ++i)
+    {
+        stage_flush(&workers[i]);
+        acc_merge(&result->acc, &workers[i].acc);
+        validate_merge(&result->check, &workers[i].check);
+    }
+
+    free(workers);
+    return ok;
+}
+
+static u32 default_worker_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (u32)info.dwNumberOfProcessors;
+}
+
 int main(int argc, char *argv[])
 {
     begin_profile();
-    if (argc != 2)
+    u32 thread_count = 0;
+    bool use_mapped = false;
+    bool atof_check = false;
+    bool validate = false;
+    acc_mode mode = AccMode_Kahan;
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i)
     {
-        fprintf(stderr, "Usage: %s file\n", argv[0]);
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            thread_count = (u32)atoi(argv[++i]);
+            if (thread_count == 0)
+                thread_count = default_worker_count();
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            use_mapped = true;
+        }
+        else if (strcmp(argv[i], "--check-atof") == 0)
+        {
+            atof_check = true;
+        }
+        else if (strcmp(argv[i], "--validate") == 0)
+        {
+            validate = true;
+        }
+        else if (strcmp(argv[i], "--generic") == 0)
+        {
+            record_shape = NULL;
+        }
+        else if (strcmp(argv[i], "--dynamic") == 0)
+        {
+            chunk_fn = process_chunk;
+        }
+        else if (strcmp(argv[i], "--tape") == 0)
+        {
+            chunk_fn = tape_chunk;
+            batch_fn = on_batch;
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            if (!acc_mode_from_name(argv[++i], &mode))
+            {
+                path = NULL;
+                break;
+            }
+        }
+        else if (!path)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "Usage: %s [-t threads] [-m] [-a mode] [--validate] [--generic] [--dynamic] [--tape] [--check-atof] file\n", argv[0]);
+        fprintf(stderr, "  -t threads  parse with N worker threads, 0 uses every core\n");
+        fprintf(stderr, "  -m          memory map the file instead of reading it in chunks (single threaded)\n");
+        fprintf(stderr, "  -a mode     reduction mode: plain, kahan (default), kahan4, kahan8, pairwise, exact\n");
+        fprintf(stderr, "  --validate  check every distance against libm and report the ulp error distribution\n");
+        fprintf(stderr, "  --generic   skip the pair record fast path and parse every object with the generic state machine\n");
+        fprintf(stderr, "  --dynamic   call the handlers through json_sax_handler_t instead of the compiled in pairs_ engine\n");
+        fprintf(stderr, "  --tape      take the events in batches from the tape engine instead of one callback each\n");
+        fprintf(stderr, "  --check-atof  compare the number parsers against strtod for every number in the file\n");
         return 1;
     }
 
-    const char *path = argv[1];
-    json_sax_handler_t h = {
-        .error = on_error,
-        .end_object = on_end_object,
-        .number = on_number};
+    if (atof_check)
+        return check_atof(path) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    handler_ud_t ud;
+    // The staging buffers are too big to comfortably live on the stack next to the read buffer
+    static handler_ud_t ud;
     memset(&ud, 0, sizeof(ud));
-    memset(&ud.current, 0, sizeof(pair_t));
-    acc_init(&ud.acc);
+    acc_init_mode(&ud.acc, mode);
+    ud.validate = validate;
+    validate_init(&ud.check);
 
-    if (!parse_file_with_sax(path, &h, &ud))
+    if (thread_count > 0)
     {
-        return EXIT_FAILURE;
+        if (thread_count > MAX_WORKERS)
+            thread_count = MAX_WORKERS;
+        if (!parse_pairs_parallel(path, thread_count, &ud))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        json_sax_handler_t h = {
+            .error = on_error,
+            .end_object = on_end_object,
+            .number = on_number,
+            .record_shape = record_shape,
+            .paths = pair_paths,
+            .path_count = 1,
+            .on_batch = batch_fn};
+
+        bool ok = use_mapped ? parse_mapped_with(path, chunk_fn, &h, &ud) : parse_file_with(path, chunk_fn, &h, &ud);
+        if (!ok)
+        {
+            return EXIT_FAILURE;
+        }
+        stage_flush(&ud);
     }
 
     f64 avg = acc_average(&ud.acc);
@@ -221,7 +526,9 @@ int main(int argc, char *argv[])
     // === DISPLAY RESULT ===
     end_and_print_profile();
     f64 ref_avg = 10011.8833483597973100;
-    printf("Result %.16f, error: %.15f\n", avg, ref_avg - avg);
+    printf("Result %.16f, error: %.15f (%s)\n", avg, ref_avg - avg, acc_mode_names[mode]);
     // printf("Result %.16f, error: %.15f\n", basic_avg, ref_avg - basic_avg);
+    if (validate)
+        print_validation(&ud.check, avg);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,663 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <windows.h>
+
+#include "common.h"
+
+// === BINARY PAIR FORMAT ===
+// A file is a pair_file_header followed by ChunkCount chunks. Each chunk is a pair_chunk_header followed by
+// its payload, PairCount pairs stored either interleaved (x0 y0 x1 y1, x0 y0 ...) or as four columns
+// (x0 x0 ..., y0 y0 ..., x1 x1 ..., y1 y1 ...), as f64 or f32. Every chunk except the last one holds exactly
+// ChunkPairCount pairs. All values are little endian.
+#define PAIR_FILE_MAGIC "HAVPAIRS"
+#define PAIR_FILE_VERSION 1
+#define PAIR_CHUNK_DEFAULT 16384
+#define PAIR_CHUNK_MAX (1024 * 1024)
+
+typedef enum
+{
+    PairLayout_AoS = 0,
+    PairLayout_SoA = 1,
+
+    PairLayout_Count,
+} pair_layout;
+
+typedef enum
+{
+    PairType_F64 = 0,
+    PairType_F32 = 1,
+
+    PairType_Count,
+} pair_type;
+
+typedef struct
+{
+    u8 Magic[8];
+    u32 Version;
+    u32 HeaderSize;
+    u64 PairCount;
+    u64 ChunkCount;
+    u32 ChunkPairCount;
+    u32 Layout;
+    u32 ElementType;
+    u32 Reserved;
+    f64 ReferenceMean;  // NaN when the writer didn't know it
+    u64 DataChecksum;   // pair_checksum over the Checksum field of every chunk, in order
+    u64 HeaderChecksum; // pair_checksum of the header up to this field
+} pair_file_header;
+
+typedef struct
+{
+    u32 PairCount;
+    u32 Reserved;
+    u64 Checksum; // pair_checksum of the payload
+} pair_chunk_header;
+
+static size_t pair_element_size(u32 element_type)
+{
+    return element_type == PairType_F32 ? sizeof(f32) : sizeof(f64);
+}
+
+static size_t pair_payload_size(const pair_file_header *header, u32 pair_count)
+{
+    return (size_t)pair_count * 4 * pair_element_size(header->ElementType);
+}
+
+// Fletcher style checksum over 32 bit words. a sums the words, b sums the running a, both wrap at 2^64.
+// Cheap enough to run at memory speed and still catches flipped, dropped and reordered words.
+typedef struct
+{
+    u64 a;
+    u64 b;
+} pair_checksum_t;
+
+static void pair_checksum_update(pair_checksum_t *c, const void *data, size_t size)
+{
+    const u8 *p = data;
+    u64 a = c->a;
+    u64 b = c->b;
+    size_t word_count = size / sizeof(u32);
+    for (size_t i = 0; i < word_count; ++i)
+    {
+        u32 w;
+        memcpy(&w, p + i * sizeof(u32), sizeof(w));
+        a += w;
+        b += a;
+    }
+    for (size_t i = word_count * sizeof(u32); i < size; ++i)
+    {
+        a += p[i];
+        b += a;
+    }
+    c->a = a;
+    c->b = b;
+}
+
+static u64 pair_checksum_final(const pair_checksum_t *c)
+{
+    return c->a ^ ((c->b << 32) | (c->b >> 32));
+}
+
+static u64 pair_checksum(const void *data, size_t size)
+{
+    pair_checksum_t c = {0, 0};
+    pair_checksum_update(&c, data, size);
+    return pair_checksum_final(&c);
+}
+
+static u64 pair_header_checksum(const pair_file_header *header)
+{
+    return pair_checksum(header, offsetof(pair_file_header, HeaderChecksum));
+}
+
+static void pair_header_init(pair_file_header *header, pair_layout layout, pair_type element_type, u32 chunk_pair_count)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->Magic, PAIR_FILE_MAGIC, sizeof(header->Magic));
+    header->Version = PAIR_FILE_VERSION;
+    header->HeaderSize = sizeof(pair_file_header);
+    header->ChunkPairCount = chunk_pair_count ? chunk_pair_count : PAIR_CHUNK_DEFAULT;
+    header->Layout = layout;
+    header->ElementType = element_type;
+    header->ReferenceMean = NAN;
+}
+
+/// @brief Checks everything in the header that can be checked without reading the chunks
+/// @param file_size Size of the whole file, header included. The chunks the header describes have to fill it exactly.
+/// @return NULL if the header is valid, otherwise a description of the problem
+static const char *pair_header_validate(const pair_file_header *header, u64 file_size)
+{
+    if (memcmp(header->Magic, PAIR_FILE_MAGIC, sizeof(header->Magic)) != 0)
+        return "not a pair file (bad magic)";
+    if (header->Version != PAIR_FILE_VERSION)
+        return "unsupported pair file version";
+    if (header->HeaderSize != sizeof(pair_file_header))
+        return "unexpected header size";
+    if (header->HeaderChecksum != pair_header_checksum(header))
+        return "header checksum mismatch";
+    if (header->Layout >= PairLayout_Count)
+        return "unknown pair layout";
+    if (header->ElementType >= PairType_Count)
+        return "unknown element type";
+    if (header->ChunkPairCount == 0 || header->ChunkPairCount > PAIR_CHUNK_MAX)
+        return "chunk pair count out of range";
+    // Rounded up without adding to PairCount first, which a crafted header could make wrap
+    u64 full_chunks = header->PairCount / header->ChunkPairCount;
+    u32 last_pairs = (u32)(header->PairCount % header->ChunkPairCount);
+    u64 expected_chunks = full_chunks + (last_pairs != 0);
+    if (header->ChunkCount != expected_chunks)
+        return "chunk count doesn't match pair count";
+
+    // A chunk is at most PAIR_CHUNK_MAX pairs, so only the number of full chunks can overflow the product
+    u64 chunk_bytes = sizeof(pair_chunk_header) + pair_payload_size(header, header->ChunkPairCount);
+    u64 last_bytes = last_pairs ? sizeof(pair_chunk_header) + pair_payload_size(header, last_pairs) : 0;
+    u64 data_bytes = file_size - sizeof(pair_file_header);
+    if (file_size < sizeof(pair_file_header) || full_chunks > data_bytes / chunk_bytes ||
+        full_chunks * chunk_bytes + last_bytes != data_bytes)
+        return "file size doesn't match pair count";
+
+    return NULL;
+}
+
+// === READ AHEAD ===
+// A background thread reads whole chunks into a ring of slots while the caller decodes the previous slot
+// in place, so I/O overlaps with compute and memory stays at READ_AHEAD_SLOTS * slot size.
+#define READ_AHEAD_SLOTS 2
+
+typedef struct
+{
+    u8 *data;
+    size_t size;     // bytes actually read
+    u64 chunk_count; // chunks the slot should hold
+} read_ahead_slot_t;
+
+typedef struct
+{
+    FILE *f;
+    u64 chunk_count;     // chunks left in the file when read ahead started
+    size_t chunk_bytes;  // size of a full chunk, header included
+    u64 chunks_per_slot;
+
+    read_ahead_slot_t slots[READ_AHEAD_SLOTS];
+    HANDLE empty[READ_AHEAD_SLOTS];
+    HANDLE full[READ_AHEAD_SLOTS];
+    HANDLE thread;
+    volatile bool stop;
+
+    // Reader thread side
+    u64 read_tsc;
+
+    // Consumer side
+    u32 slot_index;
+    bool holding_slot;
+    u64 chunk_in_slot;
+    size_t offset;
+    u64 slots_consumed;
+    u64 slots_stalled;
+    u64 stall_tsc;
+    u64 max_stall_tsc;
+} read_ahead_t;
+
+// === STREAMING READER ===
+// Reads one chunk at a time into a fixed buffer, so memory use only depends on the chunk size.
+// Each chunk is validated and handed out as four f64 columns regardless of how it was stored.
+typedef struct
+{
+    FILE *f;
+    pair_file_header header;
+    const char *error;
+
+    u64 chunks_read;
+    u64 pairs_read;
+    pair_checksum_t data_checksum;
+
+    u8 *payload;
+    f64 *columns[4]; // x0, y0, x1, y1 of the current chunk
+    size_t count;    // pairs in the current chunk
+
+    read_ahead_t *ahead; // NULL when reading synchronously
+} pair_reader_t;
+
+static void read_ahead_stop(read_ahead_t *ra);
+
+static void pair_reader_close(pair_reader_t *r)
+{
+    if (r->ahead)
+    {
+        read_ahead_stop(r->ahead);
+        free(r->ahead);
+        r->ahead = NULL;
+    }
+    if (r->f)
+        fclose(r->f);
+    free(r->payload);
+    free(r->columns[0]);
+    r->f = NULL;
+    r->payload = NULL;
+    r->columns[0] = NULL;
+}
+
+static bool pair_reader_open(pair_reader_t *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (!r->f)
+    {
+        r->error = "unable to open file";
+        return false;
+    }
+
+    if (fread(&r->header, sizeof(r->header), 1, r->f) != 1)
+    {
+        r->error = "file too short for a header";
+        pair_reader_close(r);
+        return false;
+    }
+
+    struct __stat64 file_stat;
+    if (_stat64(path, &file_stat) != 0)
+    {
+        r->error = "unable to get the file size";
+        pair_reader_close(r);
+        return false;
+    }
+
+    r->error = pair_header_validate(&r->header, (u64)file_stat.st_size);
+    if (r->error)
+    {
+        pair_reader_close(r);
+        return false;
+    }
+
+    u32 max_pairs = r->header.ChunkPairCount;
+    r->payload = malloc(pair_payload_size(&r->header, max_pairs));
+    f64 *columns = malloc((size_t)max_pairs * 4 * sizeof(f64));
+    if (!r->payload || !columns)
+    {
+        free(columns);
+        r->error = "unable to allocate chunk buffers";
+        pair_reader_close(r);
+        return false;
+    }
+    for (u32 i = 0; i < 4; ++i)
+        r->columns[i] = columns + (size_t)i * max_pairs;
+
+    return true;
+}
+
+/// @brief Validates a raw chunk and expands its payload into r->columns
+static bool pair_reader_decode(pair_reader_t *r, const pair_chunk_header *chunk, const u8 *payload)
+{
+    const pair_file_header *h = &r->header;
+    bool is_last = (r->chunks_read + 1 == h->ChunkCount);
+    if (chunk->PairCount == 0 || chunk->PairCount > h->ChunkPairCount ||
+        (!is_last && chunk->PairCount != h->ChunkPairCount) ||
+        r->pairs_read + chunk->PairCount > h->PairCount)
+    {
+        r->error = "chunk pair count is inconsistent with the header";
+        return false;
+    }
+
+    size_t payload_size = pair_payload_size(h, chunk->PairCount);
+    if (pair_checksum(payload, payload_size) != chunk->Checksum)
+    {
+        r->error = "chunk checksum mismatch";
+        return false;
+    }
+
+    size_t n = chunk->PairCount;
+    if (h->ElementType == PairType_F64 && h->Layout == PairLayout_SoA)
+    {
+        for (u32 c = 0; c < 4; ++c)
+            memcpy(r->columns[c], payload + c * n * sizeof(f64), n * sizeof(f64));
+    }
+    else if (h->ElementType == PairType_F64)
+    {
+        const u8 *at = payload;
+        for (size_t i = 0; i < n; ++i)
+        {
+            for (u32 c = 0; c < 4; ++c, at += sizeof(f64))
+                memcpy(&r->columns[c][i], at, sizeof(f64));
+        }
+    }
+    else
+    {
+        // float32 files trade precision for half the bytes, widen back to f64 for the math
+        size_t pair_stride = (h->Layout == PairLayout_AoS) ? 4 : 1;
+        size_t column_stride = (h->Layout == PairLayout_AoS) ? 1 : n;
+        for (u32 c = 0; c < 4; ++c)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                f32 v;
+                memcpy(&v, payload + (i * pair_stride + c * column_stride) * sizeof(f32), sizeof(v));
+                r->columns[c][i] = (f64)v;
+            }
+        }
+    }
+
+    r->count = n;
+    r->chunks_read++;
+    r->pairs_read += n;
+    pair_checksum_update(&r->data_checksum, &chunk->Checksum, sizeof(chunk->Checksum));
+    return true;
+}
+
+/// @brief Checks the totals once every chunk has been read
+static bool pair_reader_finish(pair_reader_t *r)
+{
+    if (r->pairs_read != r->header.PairCount)
+        r->error = "file ended before the pair count in the header";
+    else if (pair_checksum_final(&r->data_checksum) != r->header.DataChecksum)
+        r->error = "data checksum mismatch";
+
+    return r->error == NULL;
+}
+
+static DWORD WINAPI read_ahead_thread(LPVOID param)
+{
+    read_ahead_t *ra = param;
+    u64 chunks_queued = 0;
+    for (u32 slot_index = 0; chunks_queued < ra->chunk_count; slot_index = (slot_index + 1) % READ_AHEAD_SLOTS)
+    {
+        WaitForSingleObject(ra->empty[slot_index], INFINITE);
+        if (ra->stop)
+            break;
+
+        read_ahead_slot_t *slot = &ra->slots[slot_index];
+        slot->chunk_count = ra->chunk_count - chunks_queued;
+        if (slot->chunk_count > ra->chunks_per_slot)
+            slot->chunk_count = ra->chunks_per_slot;
+
+        // The last chunk in the file may be short, so the last read is allowed to come up short.
+        // The consumer bounds checks every chunk against slot->size.
+        u64 start = ReadCPUTimer();
+        slot->size = fread(slot->data, 1, slot->chunk_count * ra->chunk_bytes, ra->f);
+        ra->read_tsc += ReadCPUTimer() - start;
+
+        chunks_queued += slot->chunk_count;
+        ReleaseSemaphore(ra->full[slot_index], 1, NULL);
+    }
+
+    return 0;
+}
+
+/// @brief Starts reading chunks on a background thread. Must be called right after pair_reader_open.
+/// @param slot_bytes Size of each ring slot, rounded down to whole chunks (at least one)
+static bool pair_reader_start_read_ahead(pair_reader_t *r, size_t slot_bytes)
+{
+    read_ahead_t *ra = calloc(1, sizeof(read_ahead_t));
+    if (!ra)
+    {
+        pair_reader_close(r);
+        r->error = "unable to allocate read ahead";
+        return false;
+    }
+
+    ra->f = r->f;
+    ra->chunk_count = r->header.ChunkCount - r->chunks_read;
+    ra->chunk_bytes = sizeof(pair_chunk_header) + pair_payload_size(&r->header, r->header.ChunkPairCount);
+    ra->chunks_per_slot = slot_bytes / ra->chunk_bytes;
+    if (ra->chunks_per_slot == 0)
+        ra->chunks_per_slot = 1;
+    if (ra->chunks_per_slot > ra->chunk_count && ra->chunk_count > 0)
+        ra->chunks_per_slot = ra->chunk_count;
+
+    bool ok = true;
+    for (u32 i = 0; i < READ_AHEAD_SLOTS; ++i)
+    {
+        ra->slots[i].data = malloc(ra->chunks_per_slot * ra->chunk_bytes);
+        ra->empty[i] = CreateSemaphore(NULL, 1, 1, NULL);
+        ra->full[i] = CreateSemaphore(NULL, 0, 1, NULL);
+        if (!ra->slots[i].data || !ra->empty[i] || !ra->full[i])
+            ok = false;
+    }
+
+    if (ok)
+        ra->thread = CreateThread(NULL, 0, read_ahead_thread, ra, 0, NULL);
+
+    r->ahead = ra;
+    if (!ra->thread)
+    {
+        pair_reader_close(r);
+        r->error = "unable to start read ahead";
+        return false;
+    }
+
+    return true;
+}
+
+static void read_ahead_stop(read_ahead_t *ra)
+{
+    if (ra->thread)
+    {
+        // Wake the reader up if it's waiting on a slot, it checks stop before reading again
+        ra->stop = true;
+        for (u32 i = 0; i < READ_AHEAD_SLOTS; ++i)
+            ReleaseSemaphore(ra->empty[i], 1, NULL);
+        WaitForSingleObject(ra->thread, INFINITE);
+        CloseHandle(ra->thread);
+    }
+
+    for (u32 i = 0; i < READ_AHEAD_SLOTS; ++i)
+    {
+        free(ra->slots[i].data);
+        if (ra->empty[i])
+            CloseHandle(ra->empty[i]);
+        if (ra->full[i])
+            CloseHandle(ra->full[i]);
+    }
+}
+
+/// @brief Hands out the next chunk straight out of the current slot, waiting for the reader thread when it is behind
+static bool read_ahead_next(pair_reader_t *r, pair_chunk_header *chunk, const u8 **payload)
+{
+    read_ahead_t *ra = r->ahead;
+    if (!ra->holding_slot || ra->chunk_in_slot == ra->slots[ra->slot_index].chunk_count)
+    {
+        if (ra->holding_slot)
+        {
+            ReleaseSemaphore(ra->empty[ra->slot_index], 1, NULL);
+            ra->slot_index = (ra->slot_index + 1) % READ_AHEAD_SLOTS;
+        }
+
+        TIME_BANDWIDTH(_w, "read_ahead_wait", 0);
+        u64 start = ReadCPUTimer();
+        WaitForSingleObject(ra->full[ra->slot_index], INFINITE);
+        u64 stall = ReadCPUTimer() - start;
+        END_SCOPE(_w);
+
+        ra->holding_slot = true;
+        ra->chunk_in_slot = 0;
+        ra->offset = 0;
+        ra->slots_consumed++;
+        ra->stall_tsc += stall;
+        if (stall > ra->max_stall_tsc)
+            ra->max_stall_tsc = stall;
+        // Anything under ~1000 cycles is just the cost of the wait call on an already full slot
+        if (stall > 1000)
+            ra->slots_stalled++;
+    }
+
+    read_ahead_slot_t *slot = &ra->slots[ra->slot_index];
+    if (ra->offset + sizeof(*chunk) > slot->size)
+    {
+        r->error = "file ended before the chunk count in the header";
+        return false;
+    }
+    memcpy(chunk, slot->data + ra->offset, sizeof(*chunk));
+    ra->offset += sizeof(*chunk);
+    if (chunk->PairCount > r->header.ChunkPairCount)
+    {
+        r->error = "chunk pair count is inconsistent with the header";
+        return false;
+    }
+
+    size_t payload_size = pair_payload_size(&r->header, chunk->PairCount);
+    if (ra->offset + payload_size > slot->size)
+    {
+        r->error = "file ended in the middle of a chunk";
+        return false;
+    }
+    *payload = slot->data + ra->offset;
+    ra->offset += payload_size;
+    ra->chunk_in_slot++;
+    return true;
+}
+
+/// @brief Reads and validates the next chunk into r->columns/r->count
+/// @return False once every chunk has been read, or on error in which case r->error is set
+static bool pair_reader_next(pair_reader_t *r)
+{
+    r->count = 0;
+    if (r->error)
+        return false;
+    if (r->chunks_read == r->header.ChunkCount)
+    {
+        pair_reader_finish(r);
+        return false;
+    }
+
+    pair_chunk_header chunk;
+    if (r->ahead)
+    {
+        const u8 *payload;
+        if (!read_ahead_next(r, &chunk, &payload))
+            return false;
+        return pair_reader_decode(r, &chunk, payload);
+    }
+
+    if (fread(&chunk, sizeof(chunk), 1, r->f) != 1)
+    {
+        r->error = "file ended before the chunk count in the header";
+        return false;
+    }
+    if (chunk.PairCount > r->header.ChunkPairCount)
+    {
+        r->error = "chunk pair count is inconsistent with the header";
+        return false;
+    }
+
+    size_t payload_size = pair_payload_size(&r->header, chunk.PairCount);
+    if (fread(r->payload, 1, payload_size, r->f) != payload_size)
+    {
+        r->error = "file ended in the middle of a chunk";
+        return false;
+    }
+
+    return pair_reader_decode(r, &chunk, r->payload);
+}
+
+
+// === WRITER ===
+// Buffers one chunk in its final layout, then writes it out with its checksum.
+// The header is written last, once the totals are known.
+typedef struct
+{
+    FILE *f;
+    pair_file_header header;
+    pair_checksum_t data_checksum;
+
+    u8 *payload;
+    u32 count; // pairs in the pending chunk
+} pair_writer_t;
+
+static bool pair_writer_open(pair_writer_t *w, const char *path, pair_layout layout, pair_type element_type, u32 chunk_pair_count)
+{
+    memset(w, 0, sizeof(*w));
+    pair_header_init(&w->header, layout, element_type, chunk_pair_count);
+    if (w->header.ChunkPairCount > PAIR_CHUNK_MAX)
+        return false;
+
+    w->payload = malloc(pair_payload_size(&w->header, w->header.ChunkPairCount));
+    w->f = fopen(path, "wb");
+    if (!w->payload || !w->f)
+    {
+        if (w->f)
+            fclose(w->f);
+        free(w->payload);
+        return false;
+    }
+
+    // Placeholder until pair_writer_close knows the counts
+    return fwrite(&w->header, sizeof(w->header), 1, w->f) == 1;
+}
+
+static bool pair_writer_flush(pair_writer_t *w)
+{
+    if (w->count == 0)
+        return true;
+
+    // SoA columns are spaced for a full chunk, a short last chunk still has to come out contiguous
+    size_t element_size = pair_element_size(w->header.ElementType);
+    size_t column_size = w->count * element_size;
+    size_t column_stride = (size_t)w->header.ChunkPairCount * element_size;
+    if (w->header.Layout == PairLayout_SoA && w->count != w->header.ChunkPairCount)
+    {
+        for (u32 c = 1; c < 4; ++c)
+            memmove(w->payload + c * column_size, w->payload + c * column_stride, column_size);
+    }
+
+    size_t payload_size = pair_payload_size(&w->header, w->count);
+    pair_chunk_header chunk;
+    chunk.PairCount = w->count;
+    chunk.Reserved = 0;
+    chunk.Checksum = pair_checksum(w->payload, payload_size);
+
+    bool ok = fwrite(&chunk, sizeof(chunk), 1, w->f) == 1 &&
+              fwrite(w->payload, 1, payload_size, w->f) == payload_size;
+
+    pair_checksum_update(&w->data_checksum, &chunk.Checksum, sizeof(chunk.Checksum));
+    w->header.PairCount += w->count;
+    w->header.ChunkCount++;
+    w->count = 0;
+    return ok;
+}
+
+static bool pair_writer_add(pair_writer_t *w, f64 x0, f64 y0, f64 x1, f64 y1)
+{
+    f64 values[4] = {x0, y0, x1, y1};
+    u32 n = w->header.ChunkPairCount;
+    for (u32 c = 0; c < 4; ++c)
+    {
+        size_t index = (w->header.Layout == PairLayout_AoS) ? (size_t)w->count * 4 + c : (size_t)c * n + w->count;
+        if (w->header.ElementType == PairType_F32)
+        {
+            f32 v = (f32)values[c];
+            memcpy(w->payload + index * sizeof(f32), &v, sizeof(v));
+        }
+        else
+        {
+            memcpy(w->payload + index * sizeof(f64), &values[c], sizeof(f64));
+        }
+    }
+
+    if (++w->count == n)
+        return pair_writer_flush(w);
+    return true;
+}
+
+/// @brief Writes the last chunk and the final header, then closes the file
+/// @param reference_mean Expected mean distance for readers to check against, NaN if unknown
+static bool pair_writer_close(pair_writer_t *w, f64 reference_mean)
+{
+    bool ok = pair_writer_flush(w);
+
+    w->header.ReferenceMean = reference_mean;
+    w->header.DataChecksum = pair_checksum_final(&w->data_checksum);
+    w->header.HeaderChecksum = pair_header_checksum(&w->header);
+    if (ok)
+        ok = fseek(w->f, 0, SEEK_SET) == 0 && fwrite(&w->header, sizeof(w->header), 1, w->f) == 1;
+    if (fclose(w->f) != 0)
+        ok = false;
+
+    free(w->payload);
+    w->f = NULL;
+    w->payload = NULL;
+    return ok;
+}
@@ -15,6 +15,8 @@
 #include "common.h"
 #include "profiler.c"
 #include "_math.c"
+#include "pair_format.c"
+#include "acc.c"
 const f64 EARTH_RADIUS_KM = 6372.8;
 
 // typedef struct
@@ -26,90 +28,127 @@ const f64 EARTH_RADIUS_KM = 6372.8;
 
 typedef struct
 {
-    f64 sum;
-    f64 c;
-    size_t count;
-} acc_t;
-
-static void acc_init(acc_t *a)
-{
-    a->sum = 0.0;
-    a->c = 0.0;
-    a->count = 0;
-}
+    acc_t acc;
+    u64 tsc; // cycles spent in acc_add_block
+} reduction_t;
 
-static void acc_add(acc_t *a, f64 value)
+static void print_reduction(const reduction_t *r, f64 ref_avg, f64 freq)
 {
-    // Kahan add
-    f64 y = value - a->c;
-    f64 t = a->sum + y;
-    a->c = (t - a->sum) - y;
-    a->sum = t;
-    a->count++;
+    f64 avg = acc_average(&r->acc);
+    f64 seconds = (f64)r->tsc / freq;
+    f64 rate = seconds > 0.0 ? ((f64)r->acc.count / seconds) / 1e6 : 0.0;
+    printf("  %-8s %.16f", acc_mode_names[r->acc.mode], avg);
+    if (!isnan(ref_avg))
+        printf(", error: %.15f", ref_avg - avg);
+    printf(", %.3fms, %.1fM values/s\n", 1000.0 * seconds, rate);
 }
 
-static f64 acc_average(const acc_t *a)
+static void print_read_ahead_stats(const read_ahead_t *ra)
 {
-    if (a->count == 0)
-        return 0.0;
-    return a->sum / (f64)a->count;
+    f64 freq = (f64)GetCPUFreq(100);
+    printf("Read ahead: %llu slots of %llu chunks, %llu stalled, stall %.3fms (worst %.3fms), read %.3fms\n",
+           (unsigned long long)ra->slots_consumed, (unsigned long long)ra->chunks_per_slot,
+           (unsigned long long)ra->slots_stalled,
+           1000.0 * (f64)ra->stall_tsc / freq, 1000.0 * (f64)ra->max_stall_tsc / freq,
+           1000.0 * (f64)ra->read_tsc / freq);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    // NOTE: 4MB slots keep the two in flight buffers in L2/L3 range on most machines while still
+    // amortizing the per read syscall, 0 reads synchronously on the main thread
+    size_t slot_mb = 4;
+    const char *path = NULL;
+    u32 path_count = 0;
+    bool all_modes = false;
+    acc_mode mode = AccMode_Kahan;
+    for (int i = 1; i < argc; ++i)
     {
-        fprintf(stderr, "Usage: %s file\n", argv[0]);
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            slot_mb = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            ++i;
+            all_modes = strcmp(argv[i], "all") == 0;
+            if (!all_modes && !acc_mode_from_name(argv[i], &mode))
+                path_count = 2;
+        }
+        else
+            path = argv[i], path_count++;
+    }
+    if (path_count != 1)
+    {
+        fprintf(stderr, "Usage: %s [-s slot_mb] [-a mode] file\n", argv[0]);
+        fprintf(stderr, "  -s slot_mb  read ahead slot size in MB, 0 to read synchronously (default 4)\n");
+        fprintf(stderr, "  -a mode     reduction mode: plain, kahan (default), kahan4, kahan8, pairwise, exact\n");
+        fprintf(stderr, "              or all to run every mode over the same distances and compare them\n");
         return 1;
     }
     begin_profile();
 
-    const char *path = argv[1];
-    FILE *f = NULL;
-    f = fopen(path, "rb");
-    if (!f)
+    pair_reader_t reader;
+    if (!pair_reader_open(&reader, path) ||
+        (slot_mb && !pair_reader_start_read_ahead(&reader, slot_mb << 20)))
     {
-        perror("fopen");
+        fprintf(stderr, "%s: %s\n", path, reader.error);
         return 1;
     }
+    printf("Pairs: %llu in %llu chunks (%s, %s)\n", (unsigned long long)reader.header.PairCount,
+           (unsigned long long)reader.header.ChunkCount,
+           reader.header.Layout == PairLayout_SoA ? "SoA" : "AoS",
+           reader.header.ElementType == PairType_F32 ? "f32" : "f64");
 
-    size_t file_size = 320000000; // 40 million doubles
-    size_t count = file_size / sizeof(f64);
-    f64 *buf = (f64*)malloc(file_size);
-    if(!buf){
+    f64 *out = malloc(reader.header.ChunkPairCount * sizeof(f64));
+    if (!out)
+    {
         perror("malloc");
         return 1;
     }
-    
-    size_t n = fread(buf,sizeof(f64), count,f);
-    if (n != count){
-        perror("fread");
-        return 1;
+
+    // acc_t carries the pairwise and exact state, keep the set of them off the stack
+    static reduction_t reductions[AccMode_Count];
+    u32 reduction_count = 0;
+    for (u32 m = 0; m < AccMode_Count; ++m)
+    {
+        if (all_modes || m == (u32)mode)
+            acc_init_mode(&reductions[reduction_count++].acc, (acc_mode)m);
     }
-    fclose(f);
 
-    acc_t acc;
-    acc_init(&acc);
+    // Chunks come out of the reader as SoA f64 columns, ready for haversine_batch
+    while (pair_reader_next(&reader))
+    {
+        haversine_batch(reader.columns[0], reader.columns[1], reader.columns[2], reader.columns[3],
+                        out, reader.count, EARTH_RADIUS_KM);
+        for (u32 i = 0; i < reduction_count; ++i)
+        {
+            u64 start = ReadCPUTimer();
+            acc_add_block(&reductions[i].acc, out, reader.count);
+            reductions[i].tsc += ReadCPUTimer() - start;
+        }
+    }
 
-    size_t offset = 0;
-    f64 a = 0.0;
-    while(offset < count){
-        f64 x0 = buf[offset++];
-        f64 y0 = buf[offset++];
-        f64 x1 = buf[offset++];
-        f64 y1 = buf[offset++];
-        pair_t pair = {
-            .seen = 0,
-            .values = {x0,y0,x1,y1}
-        };
-        f64 value = haversine_distance(&pair, EARTH_RADIUS_KM);
-        acc_add(&acc, value);
-        a += value;
+    if (reader.error)
+    {
+        fprintf(stderr, "%s: %s (after %llu chunks)\n", path, reader.error, (unsigned long long)reader.chunks_read);
+        pair_reader_close(&reader);
+        free(out);
+        return 1;
     }
-    f64 avg = acc_average(&acc);
-    free(buf);
+
+    f64 ref_avg = reader.header.ReferenceMean;
+    read_ahead_t stats;
+    bool read_ahead = reader.ahead != NULL;
+    if (read_ahead)
+        stats = *reader.ahead;
+    pair_reader_close(&reader);
+    free(out);
     end_and_print_profile();
-    printf("Result acc %.16f\n", avg);
-    printf("Result   a %.16f\n", a / acc.count);
+    if (read_ahead)
+        print_read_ahead_stats(&stats);
+    if (!isnan(ref_avg))
+        printf("Reference %.16f\n", ref_avg);
+    f64 freq = (f64)GetCPUFreq(100);
+    for (u32 i = 0; i < reduction_count; ++i)
+        print_reduction(&reductions[i], ref_avg, freq);
     return 0;
-}
\ No newline at end of file
+}
@@ -4,6 +4,12 @@
 #define PROFILER 1
 #endif
 
+#if _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #if PROFILER
 #define MAX_ANCHORS 4096
 
@@ -16,8 +22,10 @@ typedef struct
     const char *Label;
 } profile_anchor;
 
-static profile_anchor GlobalProfilerAnchors[MAX_ANCHORS];
-static u32 GlobalProfilerParent = 0;
+// NOTE: Anchors are per thread so worker threads don't stomp on each other's timings.
+// Only the anchors of the thread that calls end_and_print_profile get printed.
+static THREAD_LOCAL profile_anchor GlobalProfilerAnchors[MAX_ANCHORS];
+static THREAD_LOCAL u32 GlobalProfilerParent = 0;
 
 typedef struct
 {
@@ -0,0 +1,103 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sax_json.c"
+
+// Checks that each file holds one well-formed JSON document, without parsing it for anything.
+// Prints the byte offset of the first error and exits with 1 if any file is malformed.
+
+static void usage(const char *exe)
+{
+    fprintf(stderr, "Usage: %s [--max-depth n] file...\n", exe);
+    fprintf(stderr, "       %s --self-test\n", exe);
+    fprintf(stderr, "  --max-depth n  deepest nesting of objects and arrays allowed, 0 (default) for no limit\n");
+    fprintf(stderr, "  -              reads stdin\n");
+    fprintf(stderr, "  --self-test    checks the validator against documents with known error offsets\n");
+}
+
+typedef struct
+{
+    const char *doc;
+    const char *error; // NULL if doc is well-formed
+    size_t pos;
+} validate_case_t;
+
+// Errors are reported where the offending token or UTF-8 sequence starts
+static const validate_case_t validate_cases[] = {
+    {"[1, 2.5e-3, true, null, \"a\\u00e9\"]", NULL, 0},
+    {"\"\xf0\x9f\x98\x80\\ud83d\\ude00\"", NULL, 0},
+    {"[01]", "invalid number", 1},
+    {"[1, -]", "invalid number", 4},
+    {"{\"a\": 1.}", "invalid number", 6},
+    {"[12x]", "invalid number", 1},
+    {"\"ab\xed\xa0\x80\"", "invalid UTF-8 in string", 3},  // encoded surrogate
+    {"\"\xc3\xa9\xe2\x82\"", "invalid UTF-8 in string", 3}, // sequence cut short by the quote
+    {"\"a\xc3z\"", "invalid UTF-8 in string", 2},
+    {"\"\xc0\xaf\"", "invalid UTF-8 in string", 1}, // overlong
+    {"[1 2]", "expected ',' or ']'", 3},
+    {"{\"a\" 1}", "expected ':'", 5},
+    {"[tru]", "invalid literal", 1},
+    {"\"\\ud83d\"", "unpaired high surrogate", 1},
+    {"[1,", "unexpected end of input", 3},
+};
+
+/// @brief Runs every case in validate_cases, printing the ones that come out wrong
+static bool self_test(void)
+{
+    size_t failed = 0;
+    size_t count = sizeof(validate_cases) / sizeof(validate_cases[0]);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const validate_case_t *c = &validate_cases[i];
+        json_validate_result_t result;
+        bool ok = json_validate(c->doc, strlen(c->doc), 0, &result);
+        bool pass = c->error ? !ok && strcmp(result.error, c->error) == 0 && result.pos == c->pos : ok;
+        if (!pass)
+        {
+            printf("case %zu: expected %s at %zu, got %s at %zu\n", i, c->error ? c->error : "ok", c->pos,
+                   ok ? "ok" : result.error, ok ? 0 : result.pos);
+            failed++;
+        }
+    }
+    printf("self test: %zu of %zu cases passed\n", count - failed, count);
+    return failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_depth = 0;
+    int file_count = 0;
+    bool all_ok = true;
+    if (argc == 2 && strcmp(argv[1], "--self-test") == 0)
+        return self_test() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+        {
+            max_depth = (size_t)strtoull(argv[++i], NULL, 10);
+            continue;
+        }
+
+        const char *path = argv[i];
+        json_validate_result_t result;
+        if (json_validate_file(strcmp(path, "-") == 0 ? NULL : path, max_depth, &result))
+            printf("%s: ok\n", path);
+        else
+        {
+            printf("%s: error at byte %zu: %s\n", path, result.pos, result.error);
+            all_ok = false;
+        }
+        file_count++;
+    }
+
+    if (file_count == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,12 +7,60 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#if _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 #include "sax_json.h"
 
-#define READ_BUF_SIZE 4096
+// Profiler hooks, compiled out unless the including program brings profiler.c along
+#ifndef TIME_FUNCTION
+#define TIME_BANDWIDTH(...)
+#define START_SCOPE(...)
+#define TIME_FUNCTION(...)
+#define END_SCOPE(...)
+#define RETURN_VAL(id, x) return x;
+#endif
+
+#include "json_number.c"
+
+// #define READ_BUF_SIZE 4096 * 16 // 64kb
+// Starting size of the read window, it grows for tokens that don't fit
+#ifndef READ_BUF_SIZE
+#define READ_BUF_SIZE 1024 * 256 // 256 kb
+// #define READ_BUF_SIZE 1 * 1024 * 1024 // 4MB
+#endif
 #define STRING_BUF_INIT 256
 #define STACK_INIT 64
+// Events per batch when the handlers don't bring their own tape
+#ifndef JSON_TAPE_EVENTS
+#define JSON_TAPE_EVENTS 4096
+#endif
+
+// Walk a structural index (built 64 bytes at a time) instead of every byte, set to 0 for the plain state machine
+#ifndef JSON_STRUCTURAL_INDEX
+#define JSON_STRUCTURAL_INDEX 1
+#endif
+// Reject strings and keys that aren't valid UTF-8, set to 0 to pass the bytes through unchecked
+#ifndef JSON_VALIDATE_UTF8
+#define JSON_VALIDATE_UTF8 1
+#endif
+// Bytes indexed per refill. The position buffer holds one offset per byte, the worst case
+#define JSON_INDEX_WINDOW (64 * 1024)
 
 typedef enum
 {
@@ -23,6 +71,7 @@ typedef enum
 typedef struct
 {
     ctx_type_t *data;
+    uint16_t *path; // projection path node of each container, see path_match_key
     size_t cap;
     size_t len;
 } ctx_stack_t;
@@ -32,18 +81,26 @@ static bool ctx_stack_init(ctx_stack_t *s)
     s->cap = STACK_INIT;
     s->len = 0;
     s->data = malloc(sizeof(ctx_type_t) * s->cap);
-
-    return s->data != NULL;
+    s->path = malloc(sizeof(uint16_t) * s->cap);
+    if (!s->data || !s->path)
+    {
+        free(s->data);
+        free(s->path);
+        return false;
+    }
+    return true;
 }
 
 static void ctx_stack_free(ctx_stack_t *s)
 {
     free(s->data);
+    free(s->path);
     s->data = NULL;
+    s->path = NULL;
     s->cap = s->len = 0;
 }
 
-static bool ctx_stack_push(ctx_stack_t *s, ctx_type_t v)
+static bool ctx_stack_push(ctx_stack_t *s, ctx_type_t v, uint16_t path)
 {
     if (s->len >= s->cap)
     {
@@ -52,9 +109,14 @@ static bool ctx_stack_push(ctx_stack_t *s, ctx_type_t v)
         if (!n)
             return false;
         s->data = n;
+        uint16_t *np = realloc(s->path, sizeof(uint16_t) * ncap);
+        if (!np)
+            return false;
+        s->path = np;
         s->cap = ncap;
     }
 
+    s->path[s->len] = path;
     s->data[s->len++] = v;
     return true;
 }
@@ -104,22 +166,24 @@ static void sbuf_free(sbuf_t *s)
 
 static bool sbuf_append_char(sbuf_t *s, char c)
 {
+    TIME_FUNCTION(_s);
     if (s->len + 1 >= s->cap)
     {
         size_t ncap = s->cap * 2;
         char *n = realloc(s->buf, ncap);
         if (!n)
-            return false;
+            RETURN_VAL(_s, false);
         s->buf = n;
         s->cap = ncap;
     }
     s->buf[s->len++] = c;
     s->buf[s->len] = '\0';
-    return true;
+    RETURN_VAL(_s, true);
 }
 
 static bool sbuf_append_bytes(sbuf_t *s, const char *bytes, size_t n)
 {
+    // TIME_FUNCTION(_s);
     if (s->len + n >= s->cap)
     {
         size_t ncap = s->cap;
@@ -128,6 +192,7 @@ static bool sbuf_append_bytes(sbuf_t *s, const char *bytes, size_t n)
 
         char *arr = realloc(s->buf, ncap);
         if (!arr)
+            // RETURN_VAL(_s, false);
             return false;
         s->buf = arr;
         s->cap = ncap;
@@ -136,6 +201,7 @@ static bool sbuf_append_bytes(sbuf_t *s, const char *bytes, size_t n)
     memcpy(s->buf + s->len, bytes, n);
     s->len += n;
     s->buf[s->len] = '\0';
+    // RETURN_VAL(_s, true);
     return true;
 }
 
@@ -150,7 +216,7 @@ static bool sbuf_append_utf8_codepoint(sbuf_t *s, uint32_t cp)
     }
     else if (cp <= 0x7ff)
     {
-        buf[0] = (char)(0xe0 | ((cp >> 6) & 0x1f));
+        buf[0] = (char)(0xc0 | ((cp >> 6) & 0x1f));
         buf[1] = (char)(0x80 | (cp & 0x3f));
         n = 2;
     }
@@ -191,25 +257,148 @@ typedef enum
     ST_FALSE,
     ST_NULL,
     ST_DONE,
-    ST_ERROR
+    ST_ERROR,
+    ST_SKIP // value of a key outside the projection paths
 } parse_state_t;
 
+typedef enum
+{
+    SKIP_COLON,
+    SKIP_VALUE,
+    SKIP_SCALAR,
+    SKIP_NESTED // string or container
+} skip_phase_t;
+
+// Projection paths are kept as a trie of their keys. Every open container remembers the node its contents are
+// matched against, JSON_PATH_ALL once inside a path, where nothing is filtered any more.
+#define JSON_PATH_ROOT 0
+#define JSON_PATH_ALL 0xffff
+
+typedef struct
+{
+    const char *key;
+    size_t len;
+    uint16_t parent;
+    bool terminal; // last key of a path
+} json_path_node_t;
+
+// Continuation bytes still to come in a UTF-8 sequence and the range the next one has to be in
 typedef struct
+{
+    uint8_t need;
+    uint8_t lo;
+    uint8_t hi;
+} utf8_state_t;
+
+struct json_sax_parser
 {
     json_sax_handler_t handlers;
     void *user_data;
     ctx_stack_t stack;
     sbuf_t strbuf;
     sbuf_t numbuf;
-
+    size_t num_start;
     parse_state_t state;
-    size_t position;
+    // size_t position;
+
+    // JSON Lines, input offset of the current line (reported with errors) and of the current piece
+    size_t line_start;
+    size_t line_base;
 
     // For \uXXXX sequences
     int u_remaining;
     uint16_t u_value;
     int expecting_surrogate;
-} json_sax_parser_t;
+    uint16_t high_surrogate; // first half of a pair, while expecting_surrogate
+
+    utf8_state_t utf8; // sequence cut by the end of a chunk
+
+    bool string_is_key; // the open string is an object key
+
+    // Set by read_chunks, whose next read starts with whatever wasn't consumed. A token cut by the end of a
+    // chunk is then left in place instead of being buffered, consumed is where it starts.
+    bool windowed;
+    size_t consumed;
+
+    // Batched delivery, the events not handed over yet and the chunk their text may point into
+    json_tape_event_t *tape;
+    size_t tape_count;
+    bool tape_owned;
+    const char *tape_chunk;
+    const char *tape_chunk_end;
+
+    // Record shape keys with their quotes, as a masked 8 byte pattern when they fit
+    bool has_shape;
+    uint64_t key_bits[JSON_RECORD_MAX_FIELDS];
+    uint64_t key_mask[JSON_RECORD_MAX_FIELDS];
+    size_t key_len[JSON_RECORD_MAX_FIELDS];
+
+    // Projection, path_nodes[0] is the root
+    json_path_node_t path_nodes[JSON_PATH_MAX_KEYS + 1];
+    size_t path_node_count;
+    uint16_t root_path; // JSON_PATH_ALL without paths
+    uint16_t key_path;  // node for the value of the last key
+
+    // Skipping a value, carried across chunks
+    skip_phase_t skip_phase;
+    size_t skip_depth;        // open brackets, 0 while skipping a plain string
+    uint64_t skip_in_string;  // all ones while inside a string in a container
+    uint64_t skip_escaped;    // 1 when the next byte is escaped
+
+#if JSON_STRUCTURAL_INDEX
+    uint32_t *index; // JSON_INDEX_WINDOW positions
+#endif
+};
+
+static void parser_free(json_sax_parser_t *p);
+
+/// @brief Builds the key trie from handlers.paths
+/// @return False if the paths have more than JSON_PATH_MAX_KEYS keys or an empty one
+static bool paths_init(json_sax_parser_t *p)
+{
+    p->path_node_count = 1;
+    p->path_nodes[JSON_PATH_ROOT].parent = JSON_PATH_ROOT;
+    p->root_path = p->handlers.path_count > 0 ? JSON_PATH_ROOT : JSON_PATH_ALL;
+    p->key_path = p->root_path;
+    for (size_t i = 0; i < p->handlers.path_count; ++i)
+    {
+        const char *key = p->handlers.paths[i];
+        uint16_t node = JSON_PATH_ROOT;
+        while (1)
+        {
+            size_t len = strcspn(key, ".");
+            if (len == 0)
+                return false;
+
+            uint16_t child = JSON_PATH_ROOT;
+            for (uint16_t n = 1; n < p->path_node_count; ++n)
+            {
+                json_path_node_t *pn = &p->path_nodes[n];
+                if (pn->parent == node && pn->len == len && memcmp(pn->key, key, len) == 0)
+                {
+                    child = n;
+                    break;
+                }
+            }
+            if (child == JSON_PATH_ROOT)
+            {
+                if (p->path_node_count > JSON_PATH_MAX_KEYS)
+                    return false;
+                child = (uint16_t)p->path_node_count++;
+                p->path_nodes[child].key = key;
+                p->path_nodes[child].len = len;
+                p->path_nodes[child].parent = node;
+                p->path_nodes[child].terminal = false;
+            }
+            node = child;
+            if (key[len] == '\0')
+                break;
+            key += len + 1;
+        }
+        p->path_nodes[node].terminal = true;
+    }
+    return true;
+}
 
 static bool parser_init(json_sax_parser_t *p, const json_sax_handler_t *h, void *ud)
 {
@@ -227,14 +416,66 @@ static bool parser_init(json_sax_parser_t *p, const json_sax_handler_t *h, void
         ctx_stack_free(&p->stack);
         return false;
     }
+#if JSON_STRUCTURAL_INDEX
+    p->index = malloc(sizeof(uint32_t) * JSON_INDEX_WINDOW);
+    if (!p->index)
+    {
+        sbuf_free(&p->numbuf);
+        sbuf_free(&p->strbuf);
+        ctx_stack_free(&p->stack);
+        return false;
+    }
+#endif
 
     if (h)
         p->handlers = *h;
     p->user_data = ud;
+    if (p->handlers.on_batch)
+    {
+        p->tape = p->handlers.tape;
+        if (!p->tape || p->handlers.tape_capacity == 0)
+        {
+            p->handlers.tape_capacity = JSON_TAPE_EVENTS;
+            p->tape = malloc(sizeof(json_tape_event_t) * JSON_TAPE_EVENTS);
+            p->tape_owned = true;
+            if (!p->tape)
+            {
+                parser_free(p);
+                return false;
+            }
+        }
+    }
     p->state = ST_WS;
-    p->position = 0;
+    // p->position = 0;
     p->u_remaining = 0;
     p->expecting_surrogate = 0;
+    p->num_start = 0;
+
+    if (!paths_init(p))
+    {
+        parser_free(p);
+        return false;
+    }
+
+    const json_record_shape_t *shape = p->handlers.record_shape;
+    p->has_shape = shape && shape->record && shape->field_count > 0 && shape->field_count <= JSON_RECORD_MAX_FIELDS;
+    for (size_t f = 0; p->has_shape && f < shape->field_count; ++f)
+    {
+        size_t len = strlen(shape->keys[f]) + 2;
+        if (len > sizeof(uint64_t))
+        {
+            // Keys longer than 6 characters don't fit the single compare, leave the fast path off
+            p->has_shape = false;
+            break;
+        }
+        char quoted[sizeof(uint64_t)] = {0};
+        quoted[0] = '"';
+        memcpy(quoted + 1, shape->keys[f], len - 2);
+        quoted[len - 1] = '"';
+        memcpy(&p->key_bits[f], quoted, sizeof(uint64_t));
+        p->key_mask[f] = (len == sizeof(uint64_t)) ? ~0ULL : ((1ULL << (len * 8)) - 1);
+        p->key_len[f] = len;
+    }
     return true;
 }
 
@@ -243,35 +484,32 @@ static void parser_free(json_sax_parser_t *p)
     sbuf_free(&p->strbuf);
     sbuf_free(&p->numbuf);
     ctx_stack_free(&p->stack);
+#if JSON_STRUCTURAL_INDEX
+    free(p->index);
+    p->index = NULL;
+#endif
+    if (p->tape_owned)
+        free(p->tape);
+    p->tape = NULL;
+}
+
+/// @brief Hands the events on the tape to on_batch
+static void tape_flush(json_sax_parser_t *p)
+{
+    if (p->tape_count)
+    {
+        p->handlers.on_batch(p->user_data, p->tape, p->tape_count);
+        p->tape_count = 0;
+    }
 }
 
 static void call_error(json_sax_parser_t *p, const char *msg)
 {
+    tape_flush(p);
     p->state = ST_ERROR;
     if (p->handlers.error)
-        p->handlers.error(p->user_data, msg, p->position);
-}
-
-// NOTE
-// pretty sure these can just be voids?
-// static int emit_string(json_sax_parser_t *p)
-// {
-//     if (p->handlers.string)
-//         p->handlers.string(p->user_data, p->strbuf.buf);
-//     p->strbuf.len = 0;
-//     if (p->strbuf.cap > 0)
-//         p->numbuf.buf[0] = '\0';
-//     return 0;
-// }
-
-static int emit_number(json_sax_parser_t *p)
-{
-    if (p->handlers.number)
-        p->handlers.number(p->user_data, p->numbuf.buf, p->numbuf.len);
-    p->numbuf.len = 0;
-    if (p->numbuf.cap > 0)
-        p->numbuf.buf[0] = '\0';
-    return 0;
+        // p->handlers.error(p->user_data, msg, p->position);
+        p->handlers.error(p->user_data, msg, p->line_start);
 }
 
 static int hex_val(char c)
@@ -290,648 +528,3151 @@ static inline bool iswhitespace(char c)
     return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
 }
 
-static bool process_chunk(json_sax_parser_t *parser, const char *buf, size_t buflen, int is_final)
+static inline bool isnumberchar(char c)
+{
+    return (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.' || c == 'e' || c == 'E';
+}
+
+static inline unsigned ctz32(uint32_t x)
+{
+#if _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+static inline unsigned ctz64(uint64_t x)
+{
+#if _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctzll(x);
+#endif
+}
+
+/// @brief Index of the first non whitespace byte in buf[i, len), or len
+static inline size_t skip_whitespace(const char *buf, size_t i, size_t len)
+{
+    // Mostly there's no whitespace or a single space, don't bother with vectors for that
+    if (i < len && !iswhitespace(buf[i]))
+        return i;
+    if (i + 1 < len && !iswhitespace(buf[i + 1]))
+        return i + 1;
+#if defined(__AVX2__)
+    while (i + 32 <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        uint32_t other = ~(uint32_t)_mm256_movemask_epi8(ws);
+        if (other)
+            return i + ctz32(other);
+        i += 32;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        uint32_t other = ~(uint32_t)_mm_movemask_epi8(ws) & 0xffff;
+        if (other)
+            return i + ctz32(other);
+        i += 16;
+    }
+#endif
+    while (i < len && iswhitespace(buf[i]))
+        i++;
+    return i;
+}
+
+/// @brief Index of the first '"' or '\\' in buf[i, len), or len
+static inline size_t find_quote_or_escape(const char *buf, size_t i, size_t len)
+{
+#if defined(__AVX2__)
+    while (i + 32 <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask)
+            return i + ctz32(mask);
+        i += 32;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask)
+            return i + ctz32(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && buf[i] != '"' && buf[i] != '\\')
+        i++;
+    return i;
+}
+
+/// @brief Index of the first '\n' in buf[i, len), or len
+static inline size_t find_newline(const char *buf, size_t i, size_t len)
+{
+#if defined(__AVX2__)
+    while (i + 32 <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (mask)
+            return i + ctz32(mask);
+        i += 32;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (mask)
+            return i + ctz32(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && buf[i] != '\n')
+        i++;
+    return i;
+}
+
+#if JSON_VALIDATE_UTF8
+/// @brief Feeds one byte to a sequence state
+/// @return False if it can't continue the sequence or start a new one
+static inline bool utf8_step(utf8_state_t *u, unsigned char b)
+{
+    if (u->need)
+    {
+        if (b < u->lo || b > u->hi)
+            return false;
+        u->need--;
+        u->lo = 0x80;
+        u->hi = 0xbf;
+        return true;
+    }
+    if (b < 0x80)
+        return true;
+    // The second byte range rules out overlong forms, surrogates and anything past U+10FFFF
+    u->lo = 0x80;
+    u->hi = 0xbf;
+    if (b >= 0xc2 && b <= 0xdf)
+        u->need = 1;
+    else if (b >= 0xe0 && b <= 0xef)
+    {
+        u->need = 2;
+        if (b == 0xe0)
+            u->lo = 0xa0;
+        else if (b == 0xed)
+            u->hi = 0x9f;
+    }
+    else if (b >= 0xf0 && b <= 0xf4)
+    {
+        u->need = 3;
+        if (b == 0xf0)
+            u->lo = 0x90;
+        else if (b == 0xf4)
+            u->hi = 0x8f;
+    }
+    else
+        return false;
+    return true;
+}
+
+/// @brief Length of the ASCII run at the start of s[0, len)
+static inline size_t ascii_prefix(const unsigned char *s, size_t len)
 {
     size_t i = 0;
-    while (i < buflen)
+#if defined(__AVX2__)
+    while (i + 32 <= len)
     {
-        char c = buf[i];
-        parser->position++;
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (mask)
+            return i + ctz32(mask);
+        i += 32;
+    }
+#endif
+    while (i + 8 <= len)
+    {
+        uint64_t word;
+        memcpy(&word, s + i, 8);
+        word &= 0x8080808080808080ULL;
+        if (word)
+            return i + ctz64(word) / 8;
+        i += 8;
+    }
+    while (i < len && s[i] < 0x80)
+        i++;
+    return i;
+}
+
+#if defined(__AVX2__)
+// Lookup table validation after Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+// Every byte is classified by its high nibble, its predecessor's high and low nibble, each lookup giving the
+// errors that combination could be part of. Whatever survives the and of the three is a real error, except
+// for continuations that turn out to be the third or fourth byte of a sequence.
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS ((char)0x80) // the sign bit, so every combination still fits the char arguments of the tables
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
 
-        switch (parser->state)
+/// @brief input shifted right by n bytes across the two lanes, with the last bytes of prev shifted in
+#define UTF8_PREV(input, prev, n) _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+static inline __m256i utf8_block_errors(__m256i input, __m256i prev_input)
+{
+    const __m256i byte_1_high_table = UTF8_TABLE(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m256i byte_1_low_table = UTF8_TABLE(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m256i byte_2_high_table = UTF8_TABLE(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i prev1 = UTF8_PREV(input, prev_input, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Two continuations in a row are fine when the byte two or three back leads a longer sequence
+    __m256i prev2 = UTF8_PREV(input, prev_input, 2);
+    __m256i prev3 = UTF8_PREV(input, prev_input, 3);
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+/// @brief Nonzero where the last bytes of a block start a sequence that runs into the next block
+static inline __m256i utf8_block_incomplete(__m256i input)
+{
+    const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    return _mm256_subs_epu8(input, max);
+}
+#endif
+
+/// @brief Validates s[0, len), which has to start and end on sequence boundaries. Mostly the bytes are ASCII,
+/// those blocks only cost the check for a set high bit.
+static bool utf8_valid(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    while (i < len)
+    {
+        __m256i input;
+        if (len - i >= 32)
+            input = _mm256_loadu_si256((const __m256i *)(s + i));
+        else
+        {
+            // The zero padding is ASCII, a sequence cut by the end still shows up as too short
+            unsigned char tail[32] = {0};
+            memcpy(tail, s + i, len - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        if (_mm256_movemask_epi8(input) == 0)
+            error = _mm256_or_si256(error, prev_incomplete);
+        else
+        {
+            error = _mm256_or_si256(error, utf8_block_errors(input, prev_input));
+            prev_incomplete = utf8_block_incomplete(input);
+        }
+        prev_input = input;
+        i += 32;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+#else
+    utf8_state_t state = {0};
+    while (i < len)
+    {
+        if (state.need == 0)
+        {
+            i += ascii_prefix(s + i, len - i);
+            if (i == len)
+                break;
+        }
+        if (!utf8_step(&state, s[i]))
+            return false;
+        i++;
+    }
+    return state.need == 0;
+#endif
+}
+
+/// @brief Validates the next raw piece of the open string. A sequence cut by the end of the chunk is carried
+/// over in p and finished at the start of the next piece.
+/// @param at_end The piece ends at an escape or the closing quote, which can't be inside a sequence
+/// @return False after reporting invalid UTF-8
+static bool check_string_utf8(json_sax_parser_t *p, const char *str, size_t len, bool at_end)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0;
+    bool ok = true;
+    while (ok && p->utf8.need && i < len)
+        ok = utf8_step(&p->utf8, s[i++]);
+    if (ok && !p->utf8.need)
+    {
+        // Most strings, keys in particular, are plain ASCII and end here
+        i += ascii_prefix(s + i, len - i);
+        if (i == len)
+            return true;
+    }
+
+    // Hold back a sequence that runs past the end of the piece
+    size_t cut = len;
+    for (size_t back = 1; ok && back <= 3 && back <= len - i; ++back)
+    {
+        unsigned char b = s[len - back];
+        if (b < 0x80)
+            break;
+        if (b >= 0xc0)
+        {
+            size_t seq = b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : 2;
+            if (seq > back)
+                cut = len - back;
+            break;
+        }
+    }
+    ok = ok && utf8_valid(s + i, cut - i);
+    for (i = cut; ok && i < len; ++i)
+        ok = utf8_step(&p->utf8, s[i]);
+
+    if (ok && (!at_end || p->utf8.need == 0))
+        return true;
+    p->utf8.need = 0;
+    call_error(p, "invalid UTF-8 in string");
+    return false;
+}
+#else
+static inline bool check_string_utf8(json_sax_parser_t *p, const char *str, size_t len, bool at_end)
+{
+    (void)p, (void)str, (void)len, (void)at_end;
+    return true;
+}
+#endif
+
+/// @brief Consumes the hex digits of a \\uXXXX escape from buf[*i, len), they may be split across chunks
+static bool parse_unicode_escape(json_sax_parser_t *parser, const char *buf, size_t *i, size_t len)
+{
+    while (parser->u_remaining > 0 && *i < len)
+    {
+        int v = hex_val(buf[*i]);
+        if (v < 0)
+        {
+            call_error(parser, "invalid hex in \\u escape");
+            return false;
+        }
+        parser->u_value = (uint16_t)((parser->u_value << 4) | (uint16_t)v);
+        parser->u_remaining--;
+        (*i)++;
+    }
+    if (parser->u_remaining > 0)
+        return true;
+
+    uint32_t cp = parser->u_value;
+    parser->u_value = 0;
+    // handle surrogate pairs
+    if (parser->expecting_surrogate)
+    {
+        parser->expecting_surrogate = 0;
+        if (cp < 0xdc00 || cp > 0xdfff)
+        {
+            call_error(parser, "unpaired high surrogate");
+            return false;
+        }
+        cp = 0x10000 + (((uint32_t)parser->high_surrogate - 0xd800) << 10) + (cp - 0xdc00);
+    }
+    else if (0xd800 <= cp && cp <= 0xdbff)
+    {
+        // high surrogate, the low one has to follow as the next escape
+        parser->expecting_surrogate = 1;
+        parser->high_surrogate = (uint16_t)cp;
+        return true;
+    }
+    else if (0xdc00 <= cp && cp <= 0xdfff)
+    {
+        // low surrogate
+        call_error(parser, "unexpected low surrogate");
+        return false;
+    }
+    if (!sbuf_append_utf8_codepoint(&parser->strbuf, cp))
+    {
+        call_error(parser, "alloc failure");
+        return false;
+    }
+    return true;
+}
+
+// Bit i of the result is the xor of bits 0..i, i.e. set from an opening quote up to (not including) the closing one
+static inline uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/// @brief Bytes escaped by a backslash in a 64 byte block
+/// @param prev_escaped In: 1 if the first byte is escaped by the last block. Out: the same for the next block.
+static inline uint64_t escaped_bits(uint64_t backslash, uint64_t *prev_escaped)
+{
+    // Backslashes only turn up inside strings and rarely at that, so a loop over them is cheaper than
+    // the carry-less odd/even sequence trick
+    uint64_t escaped = *prev_escaped;
+    backslash &= ~escaped;
+    *prev_escaped = 0;
+    while (backslash)
+    {
+        uint64_t bit = backslash & (0 - backslash);
+        uint64_t next = bit << 1;
+        if (!next)
+            *prev_escaped = 1;
+        escaped |= next;
+        backslash &= ~(bit | next);
+    }
+    return escaped;
+}
+
+static inline unsigned popcount64(uint64_t x)
+{
+#if _MSC_VER
+    return (unsigned)__popcnt64(x);
+#else
+    return (unsigned)__builtin_popcountll(x);
+#endif
+}
+
+/// @brief Trie node for the value of key in the current object, JSON_PATH_ALL if the key is inside a path
+/// @return False if the key leads to none of the projection paths
+static inline bool path_match_key(json_sax_parser_t *p, const char *key, size_t len)
+{
+    uint16_t node = p->stack.path[p->stack.len - 1];
+    if (node == JSON_PATH_ALL)
+    {
+        p->key_path = JSON_PATH_ALL;
+        return true;
+    }
+    for (uint16_t n = 1; n < p->path_node_count; ++n)
+    {
+        const json_path_node_t *pn = &p->path_nodes[n];
+        if (pn->parent == node && pn->len == len && memcmp(pn->key, key, len) == 0)
+        {
+            p->key_path = pn->terminal ? JSON_PATH_ALL : n;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Trie node for a container starting at the current position
+static inline uint16_t value_path(const json_sax_parser_t *p)
+{
+    if (p->stack.len == 0)
+        return p->root_path;
+    if (p->stack.data[p->stack.len - 1] == CTX_OBJECT)
+        return p->key_path;
+    return p->stack.path[p->stack.len - 1];
+}
+
+static inline uint16_t path_top(const json_sax_parser_t *p)
+{
+    return p->stack.len ? p->stack.path[p->stack.len - 1] : p->root_path;
+}
+
+/// @brief Starts skipping the ':' and value that follow a key outside the projection paths
+static inline void begin_skip(json_sax_parser_t *p)
+{
+    p->state = ST_SKIP;
+    p->skip_phase = SKIP_COLON;
+    p->skip_depth = 0;
+    p->skip_in_string = 0;
+    p->skip_escaped = 0;
+}
+
+typedef struct
+{
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t open;  // {[
+    uint64_t close; // }]
+} json_bracket_block_t;
+
+static inline json_bracket_block_t classify_brackets(const char *p)
+{
+    json_bracket_block_t b;
+#if defined(__AVX2__)
+#define BLOCK_EQ(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+#define BLOCK_MASK(lo, hi) ((uint64_t)(uint32_t)_mm256_movemask_epi8(lo) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32))
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i lo_low = _mm256_or_si256(lo, _mm256_set1_epi8(0x20));
+    __m256i hi_low = _mm256_or_si256(hi, _mm256_set1_epi8(0x20));
+    b.quote = BLOCK_MASK(BLOCK_EQ(lo, '"'), BLOCK_EQ(hi, '"'));
+    b.backslash = BLOCK_MASK(BLOCK_EQ(lo, '\\'), BLOCK_EQ(hi, '\\'));
+    b.open = BLOCK_MASK(BLOCK_EQ(lo_low, '{'), BLOCK_EQ(hi_low, '{'));
+    b.close = BLOCK_MASK(BLOCK_EQ(lo_low, '}'), BLOCK_EQ(hi_low, '}'));
+#undef BLOCK_EQ
+#undef BLOCK_MASK
+#else
+    b.quote = b.backslash = b.open = b.close = 0;
+    for (int i = 0; i < 64; ++i)
+    {
+        uint64_t bit = 1ULL << i;
+        char c = p[i];
+        if (c == '"')
+            b.quote |= bit;
+        else if (c == '\\')
+            b.backslash |= bit;
+        else if (c == '{' || c == '[')
+            b.open |= bit;
+        else if (c == '}' || c == ']')
+            b.close |= bit;
+    }
+#endif
+    return b;
+}
+
+/// @brief Runs over the rest of a skipped string or container from buf[i], 64 bytes at a time. Brackets are
+/// counted with a popcount per block, only a block where the depth could reach zero is walked bit by bit.
+/// @return Index just past the end of the value, or len if it carries on into the next chunk
+static size_t skip_nested(json_sax_parser_t *p, const char *buf, size_t i, size_t len)
+{
+    TIME_BANDWIDTH(_s, "skip", len - i);
+    while (i < len)
+    {
+        const char *block = buf + i;
+        size_t n = len - i;
+        char tail[64];
+        if (n < sizeof(tail))
         {
-        case ST_WS:
-        case ST_VALUE:
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, n);
+            block = tail;
+        }
+        else
+            n = sizeof(tail);
+        json_bracket_block_t b = classify_brackets(block);
+
+        uint64_t escaped = escaped_bits(b.backslash, &p->skip_escaped);
+        if (n < 64)
+            p->skip_escaped = (escaped >> n) & 1;
+        uint64_t quote = b.quote & ~escaped;
+
+        if (p->skip_depth == 0)
         {
-            if (iswhitespace(c))
+            // A plain string, it ends at the first unescaped quote
+            if (quote)
             {
-                i++;
-                continue;
+                p->state = ST_AFTER_COLON;
+                RETURN_VAL(_s, i + ctz64(quote) + 1);
             }
-            if (c == '{')
+            i += n;
+            continue;
+        }
+
+        uint64_t in_string = prefix_xor(quote) ^ p->skip_in_string;
+        uint64_t open = b.open & ~in_string;
+        uint64_t close = b.close & ~in_string;
+        if (popcount64(close) < p->skip_depth)
+            p->skip_depth = p->skip_depth + popcount64(open) - popcount64(close);
+        else
+        {
+            uint64_t brackets = open | close;
+            while (brackets)
             {
-                if (parser->handlers.start_object)
-                    parser->handlers.start_object(parser->user_data);
-                if (!ctx_stack_push(&parser->stack, CTX_OBJECT))
+                uint64_t bit = brackets & (0 - brackets);
+                if (open & bit)
+                    p->skip_depth++;
+                else if (--p->skip_depth == 0)
                 {
-                    call_error(parser, "stack push failed");
-                    return false;
+                    p->state = ST_AFTER_COLON;
+                    RETURN_VAL(_s, i + ctz64(bit) + 1);
                 }
-                parser->state = ST_OBJECT_KEY;
-                i++;
-                continue;
+                brackets ^= bit;
             }
-            else if (c == '[')
+        }
+        p->skip_in_string = (uint64_t)((int64_t)in_string >> 63);
+        i += n;
+    }
+    RETURN_VAL(_s, len);
+}
+
+/// @brief Skips the ':' and value after a key outside the projection paths, without emitting or decoding any
+/// of it. Inside the value only the brackets outside of strings are checked.
+/// @return Index just past the value, or len if it carries on into the next chunk or on an error
+static size_t skip_value(json_sax_parser_t *p, const char *buf, size_t i, size_t len)
+{
+    while (i < len && p->state == ST_SKIP)
+    {
+        switch (p->skip_phase)
+        {
+        case SKIP_COLON:
+        {
+            i = skip_whitespace(buf, i, len);
+            if (i == len)
+                break;
+            if (buf[i] != ':')
             {
-                if (parser->handlers.start_object)
-                    parser->handlers.start_object(parser->user_data);
-                if (!ctx_stack_push(&parser->stack, CTX_ARRAY))
-                {
-                    call_error(parser, "stack push failed");
-                    return false;
-                }
-                parser->state = ST_ARRAY_ELEM;
-                i++;
-                continue;
-            }
-            else if (c == '"')
-            {
-                parser->strbuf.len = 0;
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 't')
-            {
-                parser->state = ST_TRUE;
-                parser->numbuf.len = 0;
-
-                if(!sbuf_append_char(&parser->numbuf, 't')){
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                i++;
-                continue;
-            }
-            else if (c == 'f')
-            {
-                parser->state = ST_FALSE;
-                parser->numbuf.len = 0;
-                if(!sbuf_append_char(&parser->numbuf, 'f')){
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                i++;
-                continue;
-            }
-            else if (c == 'n')
-            {
-                parser->state = ST_NULL;
-                parser->numbuf.len = 0;
-                if(!sbuf_append_char(&parser->numbuf, 'n')){
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                i++;
-                continue;
-            }
-            else if (c == '-' || (c >= '0' && c <= '9'))
-            {
-                parser->numbuf.len = 0;
-                if (!sbuf_append_char(&parser->numbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                parser->state = ST_NUMBER;
-                i++;
-                continue;
-            }
-            else if (c == ']')
-            {
-                if (ctx_stack_top(&parser->stack) != CTX_ARRAY)
-                {
-                    call_error(parser, "unexpected ']'");
-                    return false;
-                }
-                ctx_stack_pop(&parser->stack);
-                if (parser->handlers.end_array)
-                    parser->handlers.end_array(parser->user_data);
-                if (parser->stack.len == 0)
-                    parser->state = ST_DONE;
-                else
-                {
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
-                }
-                i++;
-                continue;
-            }
-            else if (c == '}')
-            {
-                if (ctx_stack_top(&parser->stack) != CTX_OBJECT)
-                {
-                    call_error(parser, "unexpected '}'");
-                    return false;
-                }
-                ctx_stack_pop(&parser->stack);
-                if (parser->handlers.end_object)
-                    parser->handlers.end_object(parser->user_data);
-                if (parser->stack.len == 0)
-                    parser->state = ST_DONE;
-                else
-                {
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
-                }
-                i++;
-                continue;
-            }
-            else if (c == ',')
-            {
-                ctx_type_t top = ctx_stack_top(&parser->stack);
-                if (top == CTX_ARRAY)
-                    parser->state = ST_ARRAY_ELEM;
-                else if (top == CTX_OBJECT)
-                    parser->state = ST_OBJECT_KEY;
-                else
-                {
-                    call_error(parser, "unexpected ',' in root");
-                    return false;
-                }
-                i++;
-                continue;
-            }
-            else if (c == ':')
-            {
-                parser->state = ST_AFTER_COLON;
-                i++;
-                continue;
-            }
-            else
-            {
-                call_error(parser, "unexpected character while parser value");
-                return false;
+                call_error(p, "expected ':' after object key");
+                return len;
             }
+            p->skip_phase = SKIP_VALUE;
+            i++;
         }
         break;
-        case ST_OBJECT_KEY:
+        case SKIP_VALUE:
         {
-            if (iswhitespace(c))
+            i = skip_whitespace(buf, i, len);
+            if (i == len)
+                break;
+            char c = buf[i];
+            if (c == '{' || c == '[')
             {
+                p->skip_depth = 1;
+                p->skip_phase = SKIP_NESTED;
                 i++;
-                continue;
             }
-            if (c == '}')
+            else if (c == '"')
             {
-                if (ctx_stack_top(&parser->stack) != CTX_OBJECT)
-                {
-                    call_error(parser, "unexpected '}'");
-                    return false;
-                }
-                ctx_stack_pop(&parser->stack);
-                if (parser->handlers.end_object)
-                    parser->handlers.end_object(parser->user_data);
-                if (parser->stack.len == 0)
-                    parser->state = ST_DONE;
-                else
-                {
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
-                }
+                p->skip_depth = 0;
+                p->skip_phase = SKIP_NESTED;
                 i++;
-                continue;
             }
-            if (c == '"')
+            else if (c == ',' || c == '}' || c == ']' || c == ':')
             {
-                parser->strbuf.len = 0;
-                parser->state = ST_STRING;
-                // We use u_remaining in ST_STRING to determine if the string we're parsing is a key or a value
-                parser->u_remaining = -1;
-                i++;
-                continue;
+                call_error(p, "expected value after object key");
+                return len;
             }
-            call_error(parser, "expected object key string");
-            return false;
+            else
+                p->skip_phase = SKIP_SCALAR;
         }
         break;
-        case ST_AFTER_COLON:
+        case SKIP_SCALAR:
         {
-            if (iswhitespace(c))
-            {
+            while (i < len && !iswhitespace(buf[i]) && buf[i] != ',' && buf[i] != '}' && buf[i] != ']')
                 i++;
-                continue;
-            }
-            parser->state = ST_VALUE;
-            continue; // re-evaluate the same char in ST_VALUE
+            if (i < len)
+                p->state = ST_AFTER_COLON;
         }
         break;
-        case ST_ARRAY_ELEM:
+        case SKIP_NESTED:
+            i = skip_nested(p, buf, i, len);
+            break;
+        }
+    }
+    return i;
+}
+
+// Stage 1: classify 64 bytes at a time and keep only the positions the state machine needs to see, i.e.
+// {}[]:, outside of strings, every unescaped quote and the first byte of each number or literal.
+// Stage 2 (process_chunk, or validate_chunk for json_validate) then jumps between those positions, whitespace
+// and string contents are skipped a block at a time instead of a byte at a time.
+typedef struct
+{
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op; // {}[]:,
+    uint64_t ws;
+    uint64_t high; // bytes >= 0x80
+} json_block_t;
+
+static inline json_block_t classify_block(const char *p)
+{
+    json_block_t b;
+#if defined(__AVX2__)
+#define BLOCK_EQ(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+#define BLOCK_MASK(lo, hi) ((uint64_t)(uint32_t)_mm256_movemask_epi8(lo) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32))
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    // '[' and ']' are '{' and '}' with bit 5 cleared, so one compare each after setting it
+    __m256i lo_low = _mm256_or_si256(lo, _mm256_set1_epi8(0x20));
+    __m256i hi_low = _mm256_or_si256(hi, _mm256_set1_epi8(0x20));
+
+    b.quote = BLOCK_MASK(BLOCK_EQ(lo, '"'), BLOCK_EQ(hi, '"'));
+    b.backslash = BLOCK_MASK(BLOCK_EQ(lo, '\\'), BLOCK_EQ(hi, '\\'));
+    b.op = BLOCK_MASK(_mm256_or_si256(_mm256_or_si256(BLOCK_EQ(lo_low, '{'), BLOCK_EQ(lo_low, '}')),
+                                      _mm256_or_si256(BLOCK_EQ(lo, ':'), BLOCK_EQ(lo, ','))),
+                      _mm256_or_si256(_mm256_or_si256(BLOCK_EQ(hi_low, '{'), BLOCK_EQ(hi_low, '}')),
+                                      _mm256_or_si256(BLOCK_EQ(hi, ':'), BLOCK_EQ(hi, ','))));
+    b.ws = BLOCK_MASK(_mm256_or_si256(_mm256_or_si256(BLOCK_EQ(lo, ' '), BLOCK_EQ(lo, '\t')),
+                                      _mm256_or_si256(BLOCK_EQ(lo, '\n'), BLOCK_EQ(lo, '\r'))),
+                      _mm256_or_si256(_mm256_or_si256(BLOCK_EQ(hi, ' '), BLOCK_EQ(hi, '\t')),
+                                      _mm256_or_si256(BLOCK_EQ(hi, '\n'), BLOCK_EQ(hi, '\r'))));
+    b.high = BLOCK_MASK(lo, hi);
+#undef BLOCK_EQ
+#undef BLOCK_MASK
+#else
+    b.quote = b.backslash = b.op = b.ws = b.high = 0;
+    for (int i = 0; i < 64; ++i)
+    {
+        uint64_t bit = 1ULL << i;
+        char c = p[i];
+        if ((unsigned char)c >= 0x80)
+            b.high |= bit;
+        else if (c == '"')
+            b.quote |= bit;
+        else if (c == '\\')
+            b.backslash |= bit;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',')
+            b.op |= bit;
+        else if (iswhitespace(c))
+            b.ws |= bit;
+    }
+#endif
+    return b;
+}
+
+typedef struct
+{
+    const char *buf;
+    size_t len;
+    size_t indexed; // bytes classified so far
+    size_t base;    // offset the current window's positions are relative to
+    uint32_t *positions;
+    size_t count;
+    size_t at;
+#if JSON_VALIDATE_UTF8
+    // A bit for every block of the window that may hold invalid UTF-8, strings touching one get checked on their own
+    uint64_t utf8_suspect[JSON_INDEX_WINDOW / 64 / 64];
+    uint8_t utf8_prev[32]; // last 32 bytes of the previous block, or zeros if it was ASCII
+    bool utf8_incomplete;  // the previous block ended inside a sequence
+#endif
+
+    // Carried from one block to the next
+    uint64_t prev_in_string; // all ones while a string is open
+    uint64_t prev_escaped;   // 1 when the last block ended on a backslash that escapes the next byte
+    uint64_t prev_scalar;    // 1 when the last block ended inside a number or literal
+} json_index_t;
+
+static void index_refill(json_index_t *ix)
+{
+    size_t end = ix->indexed + JSON_INDEX_WINDOW;
+    if (end > ix->len)
+        end = ix->len;
+    TIME_BANDWIDTH(_s, "structural_index", end - ix->indexed);
+
+    ix->base = ix->indexed;
+    ix->count = 0;
+    ix->at = 0;
+#if JSON_VALIDATE_UTF8
+    memset(ix->utf8_suspect, 0, sizeof(ix->utf8_suspect));
+#if defined(__AVX2__)
+    __m256i utf8_prev = _mm256_loadu_si256((const __m256i *)ix->utf8_prev);
+#endif
+#endif
+    while (ix->indexed < end)
+    {
+        const char *p = ix->buf + ix->indexed;
+        char tail[64];
+        if (end - ix->indexed < sizeof(tail))
         {
-            if (iswhitespace(c))
-            {
-                i++;
-                continue;
-            }
-            if (c == ']')
-            {
-                if (ctx_stack_top(&parser->stack) != CTX_ARRAY)
-                {
-                    call_error(parser, "unexpected ']'");
-                    return false;
-                }
-                ctx_stack_pop(&parser->stack);
-                if (parser->handlers.end_array)
-                    parser->handlers.end_array(parser->user_data);
-                if (parser->stack.len == 0)
-                    parser->state = ST_DONE;
-                else
-                {
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
-                }
-                i++;
-                continue;
-            }
-            parser->state = ST_VALUE;
-            continue;
+            // Pad the last block with whitespace, which never produces a position
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p, end - ix->indexed);
+            p = tail;
         }
-        break;
-        case ST_STRING:
+        json_block_t b = classify_block(p);
+
+        uint64_t escaped = escaped_bits(b.backslash, &ix->prev_escaped);
+        uint64_t quote = b.quote & ~escaped;
+        uint64_t in_string = prefix_xor(quote) ^ ix->prev_in_string;
+        ix->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t scalar = ~(b.op | b.ws | quote | in_string);
+        uint64_t scalar_start = scalar & ~((scalar << 1) | ix->prev_scalar);
+        ix->prev_scalar = scalar >> 63;
+
+        uint64_t structurals = (b.op & ~in_string) | quote | scalar_start;
+        uint32_t offset = (uint32_t)(ix->indexed - ix->base);
+#if JSON_VALIDATE_UTF8
+        // Validated along with the classification, an error is flagged in the block of the byte that
+        // breaks the sequence, so a string is in the clear if the blocks from its first byte to its closing
+        // quote are. Without AVX2 every block with a byte >= 0x80 is left to the string's own check.
+        bool suspect = b.high != 0;
+#if defined(__AVX2__)
+        if (b.high)
         {
-            // parse until closing " with escape handling and \uXXXX
-            if (c == '"')
-            {
-                bool is_key = false;
-                if (parser->u_remaining == -1)
-                {
-                    is_key = true;
-                    parser->u_remaining = 0; // reset the marker
-                }
-                else
-                {
-                    is_key = false;
-                }
+            __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+            __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+            __m256i error = _mm256_or_si256(utf8_block_errors(lo, utf8_prev), utf8_block_errors(hi, lo));
+            suspect = !_mm256_testz_si256(error, error);
+            __m256i incomplete = utf8_block_incomplete(hi);
+            ix->utf8_incomplete = !_mm256_testz_si256(incomplete, incomplete);
+            utf8_prev = hi;
+        }
+        else
+        {
+            suspect = ix->utf8_incomplete;
+            ix->utf8_incomplete = false;
+            utf8_prev = _mm256_setzero_si256();
+        }
+#endif
+        if (suspect)
+            ix->utf8_suspect[offset / 4096] |= 1ULL << (offset / 64 % 64);
+#endif
+        while (structurals)
+        {
+            ix->positions[ix->count++] = offset + ctz64(structurals);
+            structurals &= structurals - 1;
+        }
+        ix->indexed += 64;
+    }
+    ix->indexed = end;
+#if JSON_VALIDATE_UTF8 && defined(__AVX2__)
+    _mm256_storeu_si256((__m256i *)ix->utf8_prev, utf8_prev);
+#endif
+    END_SCOPE(_s);
+}
 
-                if (is_key && ctx_stack_top(&parser->stack) == CTX_OBJECT && parser->handlers.key)
-                {
-                    parser->handlers.key(parser->user_data, parser->strbuf.buf);
-                }
-                else
-                {
-                    if (parser->handlers.string)
-                        parser->handlers.key(parser->user_data, parser->strbuf.buf);
-                }
-                parser->strbuf.len = 0;
-                parser->state = ST_AFTER_COLON;
-                i++;
-                continue;
-            }
-            else if (c == '\\')
-            {
-                parser->state = ST_STRING_ESC;
-                i++;
-                continue;
-            }
-            else
-            {
-                if (!sbuf_append_char(&parser->strbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                i++;
-                continue;
-            }
+/// @brief True if stage 1 found the indexed bytes [start, end) to be valid UTF-8
+static inline bool index_utf8_valid(const json_index_t *ix, size_t start, size_t end)
+{
+#if JSON_VALIDATE_UTF8
+    if (start < ix->base)
+        return false;
+    size_t last = (end - 1 - ix->base) / 64;
+    for (size_t block = (start - ix->base) / 64; block <= last; ++block)
+    {
+        if (ix->utf8_suspect[block / 64] & (1ULL << (block % 64)))
+            return false;
+    }
+#else
+    (void)ix, (void)start, (void)end;
+#endif
+    return true;
+}
+
+static inline bool index_peek(json_index_t *ix, size_t *pos)
+{
+    while (ix->at == ix->count)
+    {
+        if (ix->indexed >= ix->len)
+            return false;
+        index_refill(ix);
+    }
+    *pos = ix->base + ix->positions[ix->at];
+    return true;
+}
+
+static inline void index_skip_to(json_index_t *ix, size_t offset)
+{
+    size_t pos;
+    while (index_peek(ix, &pos) && pos < offset)
+        ix->at++;
+}
+
+/// @brief Carries on from offset, which has to be outside of any token. Skipped values jump past their bytes
+/// without indexing them.
+static inline void index_jump(json_index_t *ix, size_t offset)
+{
+    if (offset <= ix->indexed)
+    {
+        index_skip_to(ix, offset);
+        return;
+    }
+    ix->indexed = offset;
+    ix->count = ix->at = 0;
+    ix->prev_in_string = ix->prev_escaped = ix->prev_scalar = 0;
+#if JSON_VALIDATE_UTF8
+    memset(ix->utf8_prev, 0, sizeof(ix->utf8_prev));
+    ix->utf8_incomplete = false;
+#endif
+}
+
+// A number or literal has to end on whitespace or a structural character, anything else would belong to the
+// same run and never show up in the index
+static inline bool token_ends_at(const char *buf, size_t end, size_t len)
+{
+    if (end >= len)
+        return true;
+    char c = buf[end];
+    return iswhitespace(c) || c == ',' || c == ':' || c == '}' || c == ']' || c == '{' || c == '[' || c == '"';
+}
+
+#if JSON_STRUCTURAL_INDEX
+static inline bool in_token(parse_state_t state)
+{
+    return state == ST_STRING || state == ST_STRING_ESC || state == ST_NUMBER ||
+           state == ST_TRUE || state == ST_FALSE || state == ST_NULL;
+}
+
+// A token cut by the end of a chunk is left for the next one when the caller keeps the unconsumed bytes around
+#define JSON_HOLD_TOKEN(p, is_final) ((p)->windowed && !(is_final))
+
+// Longest tail a record shaped object is held back for, bigger objects can't be records anyway
+#ifndef JSON_RECORD_HOLD_MAX
+#define JSON_RECORD_HOLD_MAX 1024
+#endif
+
+/// @brief Bytes at the start of buf that finish the token the previous chunk left open, including the
+/// character that terminates a number so that it gets emitted.
+static size_t open_token_length(const json_sax_parser_t *parser, const char *buf, size_t len)
+{
+    size_t i = 0;
+    size_t need = 0;
+    switch (parser->state)
+    {
+    case ST_NUMBER:
+        while (i < len && isnumberchar(buf[i]))
+            i++;
+        return i < len ? i + 1 : len;
+    case ST_STRING:
+    case ST_STRING_ESC:
+    {
+        bool escaped = parser->state == ST_STRING_ESC;
+        for (; i < len; ++i)
+        {
+            if (escaped)
+                escaped = false;
+            else if (buf[i] == '\\')
+                escaped = true;
+            else if (buf[i] == '"')
+                return i + 1;
+        }
+        return len;
+    }
+    case ST_TRUE:
+    case ST_NULL:
+        need = 4 - parser->numbuf.len;
+        break;
+    case ST_FALSE:
+        need = 5 - parser->numbuf.len;
+        break;
+    default:
+        break;
+    }
+    return need < len ? need : len;
+}
+
+static inline void after_value(json_sax_parser_t *parser)
+{
+    ctx_type_t top = ctx_stack_top(&parser->stack);
+    if (top == CTX_ARRAY)
+        parser->state = ST_ARRAY_ELEM;
+    else if (top == CTX_OBJECT)
+        parser->state = ST_AFTER_COLON;
+    else
+        parser->state = ST_DONE;
+}
+#endif
+
+#include "sax_json_engine.h"
+
+// process_chunk, or one of the engines instantiated from sax_json_engine.h with compile time handlers. The
+// *_with functions taking one are static, programs that bring their own engine include sax_json.c to use them.
+typedef bool (*json_chunk_fn)(json_sax_parser_t *parser, const char *buf, size_t buflen, int is_final);
+
+// Batched delivery. The tape engine writes the events to the parser's tape instead of calling a handler for each,
+// and they go to on_batch when it's full and once the chunk is done. Text in the chunk stays valid until then,
+// text in strbuf or numbuf (unescaped or straddling chunks) only until the next event, so that ends the batch.
+static inline void tape_push(json_sax_parser_t *p, json_event_type_t type, const char *text, size_t len, double number)
+{
+    json_tape_event_t *e = &p->tape[p->tape_count++];
+    e->type = type;
+    e->text = text;
+    e->len = len;
+    e->number = number;
+    if (p->tape_count == p->handlers.tape_capacity || (text && (text < p->tape_chunk || text > p->tape_chunk_end)))
+        tape_flush(p);
+}
+
+#define JSON_SAX_PREFIX tape_
+#define JSON_SAX_TAPE
+#include "sax_json_engine.h"
+
+/// @brief process_chunk for handlers with on_batch
+static bool tape_chunk(json_sax_parser_t *parser, const char *buf, size_t buflen, int is_final)
+{
+    parser->tape_chunk = buf;
+    parser->tape_chunk_end = buf + buflen;
+    bool ok = tape_process_chunk(parser, buf, buflen, is_final);
+    tape_flush(parser);
+    return ok;
+}
+
+/// @brief The engine the public functions run for a set of handlers
+static json_chunk_fn handler_engine(const json_sax_handler_t *h)
+{
+    return h && h->on_batch ? tape_chunk : process_chunk;
+}
+
+/// @brief Clears the state of the last document, the input offsets stay
+static void reset_document(json_sax_parser_t *parser)
+{
+    parser->stack.len = 0;
+    parser->strbuf.len = 0;
+    parser->strbuf.buf[0] = '\0';
+    parser->numbuf.len = 0;
+    parser->numbuf.buf[0] = '\0';
+    parser->state = ST_WS;
+    parser->u_remaining = 0;
+    parser->u_value = 0;
+    parser->expecting_surrogate = 0;
+    parser->utf8.need = 0;
+    parser->string_is_key = false;
+    parser->key_path = parser->root_path;
+}
+
+// JSON Lines (NDJSON), one document per line. A raw newline can only be whitespace inside a JSON document, so
+// the lines are found with a plain byte search and each one goes through the engine with a fresh context stack.
+// Blank lines produce no events.
+
+/// @brief Feeds the lines in buf to process, the last one may carry on into the next piece
+static bool feed_lines(json_sax_parser_t *parser, json_chunk_fn process, const char *buf, size_t len, int is_final)
+{
+    if (parser->state == ST_ERROR)
+        return false;
+    size_t i = 0;
+    while (1)
+    {
+        size_t nl = find_newline(buf, i, len);
+        if (nl == len)
+            break;
+        if (!process(parser, buf + i, nl - i, 1))
+            return false;
+        reset_document(parser);
+        parser->line_start = parser->line_base + nl + 1;
+        i = nl + 1;
+    }
+    parser->consumed = len - i;
+    bool ok = process(parser, buf + i, len - i, is_final);
+    parser->consumed += i;
+    parser->line_base += parser->consumed;
+    return ok;
+}
+
+#if _WIN32
+typedef LPTHREAD_START_ROUTINE json_thread_fn;
+#define JSON_THREAD_RETURN DWORD WINAPI
+#else
+typedef void *(*json_thread_fn)(void *);
+#define JSON_THREAD_RETURN void *
+#endif
+
+typedef struct
+{
+#if _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    bool started;
+} json_thread_t;
+
+static bool thread_start(json_thread_t *t, json_thread_fn fn, void *arg)
+{
+#if _WIN32
+    t->handle = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    t->started = t->handle != NULL;
+#else
+    t->started = pthread_create(&t->handle, NULL, fn, arg) == 0;
+#endif
+    return t->started;
+}
+
+static void thread_join(json_thread_t *t)
+{
+    if (!t->started)
+        return;
+#if _WIN32
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, NULL);
+#endif
+    t->started = false;
+}
+
+#if _WIN32
+typedef SRWLOCK json_lock_t;
+typedef CONDITION_VARIABLE json_cond_t;
+#else
+typedef pthread_mutex_t json_lock_t;
+typedef pthread_cond_t json_cond_t;
+#endif
+
+static void lock_init(json_lock_t *l)
+{
+#if _WIN32
+    InitializeSRWLock(l);
+#else
+    pthread_mutex_init(l, NULL);
+#endif
+}
+
+static void lock_free(json_lock_t *l)
+{
+#if !_WIN32
+    pthread_mutex_destroy(l);
+#else
+    (void)l;
+#endif
+}
+
+static void lock_acquire(json_lock_t *l)
+{
+#if _WIN32
+    AcquireSRWLockExclusive(l);
+#else
+    pthread_mutex_lock(l);
+#endif
+}
+
+static void lock_release(json_lock_t *l)
+{
+#if _WIN32
+    ReleaseSRWLockExclusive(l);
+#else
+    pthread_mutex_unlock(l);
+#endif
+}
+
+static void cond_init(json_cond_t *c)
+{
+#if _WIN32
+    InitializeConditionVariable(c);
+#else
+    pthread_cond_init(c, NULL);
+#endif
+}
+
+static void cond_free(json_cond_t *c)
+{
+#if !_WIN32
+    pthread_cond_destroy(c);
+#else
+    (void)c;
+#endif
+}
+
+/// @brief Releases l while waiting for c to be signalled, holds it again on return
+static void cond_wait(json_cond_t *c, json_lock_t *l)
+{
+#if _WIN32
+    SleepConditionVariableSRW(c, l, INFINITE, 0);
+#else
+    pthread_cond_wait(c, l);
+#endif
+}
+
+static void cond_signal(json_cond_t *c)
+{
+#if _WIN32
+    WakeConditionVariable(c);
+#else
+    pthread_cond_signal(c);
+#endif
+}
+
+// Reader thread. Files are read, and files named *.gz or *.zst decompressed, on a thread of their own while the
+// engine parses, so waiting on the disk and decompression overlap parsing. Blocks of JSON_READER_BLOCK bytes
+// are handed over through a queue of JSON_READER_QUEUE of them, which bounds how far the reader gets ahead.
+// JSON_READ_AHEAD 0 reads plain files on the parsing thread instead, compressed ones always get the thread.
+// gzip needs zlib (JSON_SAX_GZIP) and zstd needs libzstd (JSON_SAX_ZSTD), both off by default since neither
+// ships with the compiler. Without them such files are reported as errors instead of parsed as JSON.
+#ifndef JSON_READ_AHEAD
+#define JSON_READ_AHEAD 1
+#endif
+#ifndef JSON_SAX_GZIP
+#define JSON_SAX_GZIP 0
+#endif
+#ifndef JSON_SAX_ZSTD
+#define JSON_SAX_ZSTD 0
+#endif
+#define JSON_READER_BLOCK (1024 * 256)
+#define JSON_READER_QUEUE 4
+
+#if JSON_SAX_GZIP
+#include <zlib.h>
+#endif
+#if JSON_SAX_ZSTD
+#include <zstd.h>
+#endif
+
+typedef enum
+{
+    JSON_CODEC_NONE = 0,
+    JSON_CODEC_GZIP,
+    JSON_CODEC_ZSTD
+} json_codec_t;
+
+static bool ends_with(const char *s, const char *suffix)
+{
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && memcmp(s + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/// @brief Compression of a file going by its name, stdin is always read as is
+static json_codec_t input_codec(const char *filename)
+{
+    if (!filename)
+        return JSON_CODEC_NONE;
+    if (ends_with(filename, ".gz"))
+        return JSON_CODEC_GZIP;
+    if (ends_with(filename, ".zst"))
+        return JSON_CODEC_ZSTD;
+    return JSON_CODEC_NONE;
+}
+
+typedef struct
+{
+    json_codec_t codec;
+    FILE *f;
+    char *in; // compressed bytes read from f, in[in_pos, in_len) not decompressed yet
+    size_t in_len;
+    size_t in_pos;
+    bool in_eof;
+    bool in_frame; // a gzip member or zstd frame has started and not ended yet
+#if JSON_SAX_GZIP
+    z_stream z;
+    bool z_ready;
+#endif
+#if JSON_SAX_ZSTD
+    ZSTD_DStream *zd;
+#endif
+} json_decoder_t;
+
+/// @return NULL on success, otherwise what went wrong
+static const char *decoder_init(json_decoder_t *d, json_codec_t codec, FILE *f)
+{
+    memset(d, 0, sizeof(*d));
+    d->codec = codec;
+    d->f = f;
+    if (codec == JSON_CODEC_NONE)
+        return NULL;
+    d->in = malloc(JSON_READER_BLOCK);
+    if (!d->in)
+        return "alloc failure";
+    switch (codec)
+    {
+    case JSON_CODEC_GZIP:
+#if JSON_SAX_GZIP
+        // 15 + 32: largest window, gzip or zlib header detected from the stream
+        d->z_ready = inflateInit2(&d->z, 15 + 32) == Z_OK;
+        return d->z_ready ? NULL : "alloc failure";
+#else
+        return "gzip input needs a build with JSON_SAX_GZIP";
+#endif
+    case JSON_CODEC_ZSTD:
+#if JSON_SAX_ZSTD
+        d->zd = ZSTD_createDStream();
+        if (!d->zd || ZSTD_isError(ZSTD_initDStream(d->zd)))
+            return "alloc failure";
+        return NULL;
+#else
+        return "zstd input needs a build with JSON_SAX_ZSTD";
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static void decoder_free(json_decoder_t *d)
+{
+#if JSON_SAX_GZIP
+    if (d->z_ready)
+        inflateEnd(&d->z);
+#endif
+#if JSON_SAX_ZSTD
+    ZSTD_freeDStream(d->zd);
+#endif
+    free(d->in);
+    d->in = NULL;
+}
+
+/// @brief Reads, decompressing if need be, into dst until it's full or the input ends. Concatenated gzip members
+/// and zstd frames are read one after the other, like gzip -d and zstd -d do.
+/// @param n Bytes written to dst, less than cap only at the end of the input
+/// @return NULL on success, otherwise what went wrong
+static const char *decoder_read(json_decoder_t *d, char *dst, size_t cap, size_t *n)
+{
+    TIME_BANDWIDTH(_s, __func__, cap);
+    if (d->codec == JSON_CODEC_NONE)
+    {
+        *n = fread(dst, 1, cap, d->f);
+        RETURN_VAL(_s, ferror(d->f) ? "read error" : NULL);
+    }
+    size_t out = 0;
+    while (out < cap)
+    {
+        if (d->in_pos == d->in_len && !d->in_eof)
+        {
+            d->in_len = fread(d->in, 1, JSON_READER_BLOCK, d->f);
+            d->in_pos = 0;
+            if (ferror(d->f))
+                RETURN_VAL(_s, "read error");
+            d->in_eof = d->in_len == 0;
+        }
+        // Out of input, but the decoder may still hold output it had no room for last time
+        bool starved = d->in_pos == d->in_len;
+        if (starved && !d->in_frame)
+            break;
+
+        size_t before = out;
+#if JSON_SAX_GZIP
+        if (d->codec == JSON_CODEC_GZIP)
+        {
+            size_t room = cap - out < UINT32_MAX ? cap - out : UINT32_MAX;
+            d->z.next_in = (Bytef *)d->in + d->in_pos;
+            d->z.avail_in = (uInt)(d->in_len - d->in_pos);
+            d->z.next_out = (Bytef *)dst + out;
+            d->z.avail_out = (uInt)room;
+            int rc = inflate(&d->z, Z_NO_FLUSH);
+            d->in_pos = d->in_len - d->z.avail_in;
+            out += room - d->z.avail_out;
+            if (rc == Z_STREAM_END)
+            {
+                inflateReset(&d->z);
+                d->in_frame = false;
+            }
+            else if (rc == Z_OK || rc == Z_BUF_ERROR)
+                d->in_frame = true;
+            else
+                RETURN_VAL(_s, "corrupt gzip input");
+        }
+#endif
+#if JSON_SAX_ZSTD
+        if (d->codec == JSON_CODEC_ZSTD)
+        {
+            ZSTD_inBuffer in = {d->in + d->in_pos, d->in_len - d->in_pos, 0};
+            ZSTD_outBuffer o = {dst + out, cap - out, 0};
+            size_t rc = ZSTD_decompressStream(d->zd, &o, &in);
+            if (ZSTD_isError(rc))
+                RETURN_VAL(_s, "corrupt zstd input");
+            d->in_pos += in.pos;
+            out += o.pos;
+            d->in_frame = rc != 0;
+        }
+#endif
+        if (starved && out == before)
+            RETURN_VAL(_s, "truncated compressed input");
+    }
+    *n = out;
+    RETURN_VAL(_s, NULL);
+}
+
+// Reader thread and the bounded queue between it and the parser. The reader fills block tail, the parser reads
+// block head, and a block belongs to whichever side it's waiting on, so only the counters need the lock.
+typedef struct
+{
+    json_decoder_t dec;
+    char *blocks; // JSON_READER_QUEUE blocks of JSON_READER_BLOCK bytes
+    size_t lens[JSON_READER_QUEUE];
+    size_t head;     // next block to parse
+    size_t tail;     // next block to fill
+    size_t read_pos; // bytes of the head block already taken
+    bool done;       // no block after tail, set by the reader
+    bool cancelled;  // set by the parser when it stops before the end
+    const char *error;
+    json_lock_t lock;
+    json_cond_t not_empty;
+    json_cond_t not_full;
+    json_thread_t thread; // not started means the parser reads itself
+} json_reader_t;
+
+static JSON_THREAD_RETURN reader_worker(void *param)
+{
+    json_reader_t *q = param;
+    const char *error = NULL;
+    bool end = false;
+    while (!error && !end)
+    {
+        lock_acquire(&q->lock);
+        while (q->tail - q->head == JSON_READER_QUEUE && !q->cancelled)
+            cond_wait(&q->not_full, &q->lock);
+        bool cancelled = q->cancelled;
+        lock_release(&q->lock);
+        if (cancelled)
+            break;
+
+        size_t slot = q->tail % JSON_READER_QUEUE;
+        size_t n = 0;
+        error = decoder_read(&q->dec, q->blocks + slot * JSON_READER_BLOCK, JSON_READER_BLOCK, &n);
+        end = n < JSON_READER_BLOCK;
+        if (n)
+        {
+            lock_acquire(&q->lock);
+            q->lens[slot] = n;
+            q->tail++;
+            cond_signal(&q->not_empty);
+            lock_release(&q->lock);
+        }
+    }
+    lock_acquire(&q->lock);
+    q->done = true;
+    q->error = error;
+    cond_signal(&q->not_empty);
+    lock_release(&q->lock);
+    return 0;
+}
+
+static void reader_stop(json_reader_t *q)
+{
+    if (!q)
+        return;
+    if (q->thread.started)
+    {
+        lock_acquire(&q->lock);
+        q->cancelled = true;
+        cond_signal(&q->not_full);
+        lock_release(&q->lock);
+        thread_join(&q->thread);
+    }
+    decoder_free(&q->dec);
+    cond_free(&q->not_full);
+    cond_free(&q->not_empty);
+    lock_free(&q->lock);
+    free(q->blocks);
+    free(q);
+}
+
+/// @brief Sets up reading f, decompressed as codec says, and starts its thread. Reads on the calling thread
+/// instead, in reader_take, if the thread can't be started.
+/// @return NULL on success, otherwise what went wrong
+static const char *reader_start(json_reader_t **out, json_codec_t codec, FILE *f)
+{
+    *out = NULL;
+    json_reader_t *q = calloc(1, sizeof(*q));
+    if (!q)
+        return "alloc failure";
+    lock_init(&q->lock);
+    cond_init(&q->not_empty);
+    cond_init(&q->not_full);
+    const char *error = decoder_init(&q->dec, codec, f);
+    q->blocks = error ? NULL : malloc((size_t)JSON_READER_QUEUE * JSON_READER_BLOCK);
+    if (!error && !q->blocks)
+        error = "alloc failure";
+    if (error)
+    {
+        reader_stop(q);
+        return error;
+    }
+    thread_start(&q->thread, reader_worker, q);
+    *out = q;
+    return NULL;
+}
+
+/// @brief Next decompressed bytes, up to cap of them. Waits only while there's nothing at all to return.
+/// @param is_final Set once the last byte has been taken
+/// @return Bytes written to dst
+static size_t reader_take(json_reader_t *q, char *dst, size_t cap, bool *is_final, const char **error)
+{
+    if (!q->thread.started)
+    {
+        size_t n = 0;
+        *error = decoder_read(&q->dec, dst, cap, &n);
+        *is_final = n < cap;
+        return n;
+    }
+
+    size_t out = 0;
+    lock_acquire(&q->lock);
+    while (out < cap)
+    {
+        if (q->head == q->tail)
+        {
+            if (q->done || out)
+                break;
+            cond_wait(&q->not_empty, &q->lock);
+            continue;
+        }
+        size_t slot = q->head % JSON_READER_QUEUE;
+        size_t n = q->lens[slot] - q->read_pos;
+        if (n > cap - out)
+            n = cap - out;
+        lock_release(&q->lock);
+        memcpy(dst + out, q->blocks + slot * JSON_READER_BLOCK + q->read_pos, n);
+        lock_acquire(&q->lock);
+        out += n;
+        q->read_pos += n;
+        if (q->read_pos == q->lens[slot])
+        {
+            q->read_pos = 0;
+            q->head++;
+            cond_signal(&q->not_full);
+        }
+    }
+    *is_final = q->done && q->head == q->tail;
+    *error = *is_final ? q->error : NULL;
+    lock_release(&q->lock);
+    return out;
+}
+
+/// @brief Reads f to the end through a sliding window: the bytes of a token cut by the end of one read are moved
+/// to the front of the buffer and the next read goes in behind them, so the engine sees every token whole.
+/// The window doubles when a single token doesn't fit.
+/// @param reader Reader thread of f to take the bytes from instead of reading f here, may be NULL
+static bool read_chunks(json_sax_parser_t *parser, FILE *f, json_reader_t *reader, json_chunk_fn process, bool lines)
+{
+    // START_SCOPE(_s, __func__);
+    size_t cap = READ_BUF_SIZE;
+    char *buf = malloc(cap);
+    if (!buf)
+    {
+        call_error(parser, "alloc failure");
+        return false;
+    }
+    size_t kept = 0;
+    bool ok = true;
+    parser->windowed = true;
+    while (ok)
+    {
+        if (kept == cap)
+        {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
+            {
+                call_error(parser, "alloc failure");
+                ok = false;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+
+        TIME_BANDWIDTH(_f, "fread", cap - kept);
+        size_t n;
+        int is_final;
+        const char *error = NULL;
+        if (reader)
+        {
+            bool taken_all;
+            n = reader_take(reader, buf + kept, cap - kept, &taken_all, &error);
+            is_final = taken_all;
+        }
+        else
+        {
+            n = fread(buf + kept, 1, cap - kept, f);
+            if (ferror(f))
+                error = "read error";
+            is_final = feof(f);
+        }
+        if (error)
+        {
+            call_error(parser, error);
+            ok = false;
+            END_SCOPE(_f);
+            break;
+        }
+
+        size_t avail = kept + n;
+        parser->consumed = avail;
+        ok = lines ? feed_lines(parser, process, buf, avail, is_final) : process(parser, buf, avail, is_final);
+        if (is_final)
+        {
+            END_SCOPE(_f);
+            break;
+        }
+        kept = avail - parser->consumed;
+        memmove(buf, buf + parser->consumed, kept);
+        END_SCOPE(_f);
+    }
+    parser->windowed = false;
+    free(buf);
+    // RETURN_VAL(_s, true);
+    return ok;
+}
+
+bool json_sax_parse_file(json_sax_parser_t *parser, FILE *f)
+{
+    return read_chunks(parser, f, NULL, handler_engine(&parser->handlers), false);
+}
+
+static bool read_file(const char *filename, json_chunk_fn process, bool lines, const json_sax_handler_t *h, void *ud)
+{
+    FILE *f = NULL;
+    if (!filename)
+        f = stdin;
+    else
+    {
+        f = fopen(filename, "rb");
+        if (!f)
+        {
+            perror("fopen");
+            return false;
+        }
+    }
+    json_sax_parser_t parser;
+    if (!parser_init(&parser, h, ud))
+    {
+        if (f && f != stdin)
+            fclose(f);
+        return false;
+    }
+    bool rc;
+    json_reader_t *reader = NULL;
+    json_codec_t codec = input_codec(filename);
+    const char *error = codec != JSON_CODEC_NONE || JSON_READ_AHEAD ? reader_start(&reader, codec, f) : NULL;
+    if (error)
+    {
+        call_error(&parser, error);
+        rc = false;
+    }
+    else
+        rc = read_chunks(&parser, f, reader, process, lines);
+    reader_stop(reader);
+    parser_free(&parser);
+    if (f && f != stdin)
+        fclose(f);
+
+    return rc;
+}
+
+/// @brief parse_file_with_sax with the chunks going through `process` instead of process_chunk
+static bool parse_file_with(const char *filename, json_chunk_fn process, const json_sax_handler_t *h, void *ud)
+{
+    return read_file(filename, process, false, h, ud);
+}
+
+/// @brief parse_lines_with_sax with the lines going through `process` instead of process_chunk
+static bool parse_lines_with(const char *filename, json_chunk_fn process, const json_sax_handler_t *h, void *ud)
+{
+    return read_file(filename, process, true, h, ud);
+}
+
+bool parse_file_with_sax(const char *filename, const json_sax_handler_t *h, void *ud)
+{
+    return parse_file_with(filename, handler_engine(h), h, ud);
+}
+
+static bool parse_buffer(const char *buf, size_t len, json_chunk_fn process, const json_sax_handler_t *h, void *ud)
+{
+    TIME_BANDWIDTH(_s, "mapped", len);
+    json_sax_parser_t parser;
+    if (!parser_init(&parser, h, ud))
+        RETURN_VAL(_s, false);
+
+    // The whole document is one chunk, so numbers and strings never straddle a boundary
+    // and the callbacks always get pointers straight into the mapping
+    bool rc = process(&parser, buf, len, 1);
+    parser_free(&parser);
+    RETURN_VAL(_s, rc);
+}
+
+typedef struct
+{
+    const char *data; // NULL for empty files and anything that isn't a regular file
+    size_t size;
+#if _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} json_mapping_t;
+
+/// @brief Maps a whole file read only, with the OS told it'll be read front to back
+/// @return False if the file can't be opened or mapped. True with m->data NULL if there's nothing to map
+/// (empty or not a regular file), the caller reads it in chunks instead.
+static bool map_file(const char *filename, json_mapping_t *m)
+{
+    memset(m, 0, sizeof(*m));
+#if _WIN32
+    m->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m->file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "CreateFile: unable to open %s\n", filename);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m->file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(m->file);
+        m->file = NULL;
+        return true;
+    }
+
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    m->data = m->mapping ? (const char *)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!m->data)
+    {
+        fprintf(stderr, "MapViewOfFile: unable to map %s\n", filename);
+        if (m->mapping)
+            CloseHandle(m->mapping);
+        CloseHandle(m->file);
+        return false;
+    }
+    m->size = (size_t)size.QuadPart;
+
+    // NOTE: Closest thing Windows has to MADV_SEQUENTIAL/MADV_WILLNEED, it queues up large reads for the range.
+    // There are no large pages for file backed views, so nothing to do for MADV_HUGEPAGE.
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = (void *)m->data;
+    range.NumberOfBytes = (SIZE_T)m->size;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    m->fd = open(filename, O_RDONLY);
+    if (m->fd < 0)
+    {
+        perror("open");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(m->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(m->fd);
+        return true;
+    }
+
+    m->size = (size_t)st.st_size;
+    void *data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        close(m->fd);
+        return false;
+    }
+    m->data = data;
+
+    madvise(data, m->size, MADV_SEQUENTIAL);
+    madvise(data, m->size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    // Only honored for file mappings on kernels with read-only THP for page cache, harmless otherwise
+    madvise(data, m->size, MADV_HUGEPAGE);
+#endif
+#endif
+    return true;
+}
+
+static void unmap_file(json_mapping_t *m)
+{
+    if (!m->data)
+        return;
+#if _WIN32
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+#else
+    munmap((void *)m->data, m->size);
+    close(m->fd);
+#endif
+    m->data = NULL;
+}
+
+/// @brief Same as parse_file_with but maps the whole file into memory instead of reading it in chunks.
+/// Falls back to parse_file_with for stdin, empty and compressed files.
+/// @param filename The file to parse. If filename is NULL, defaults to stdin
+/// @param process process_chunk, or an engine instantiated from sax_json_engine.h
+/// @param h SAX callback handlers
+/// @param ud User Data struct that is passed to the handlers
+/// @return True if parsing completed successfully. False on any error
+static bool parse_mapped_with(const char *filename, json_chunk_fn process, const json_sax_handler_t *h, void *ud)
+{
+    if (!filename || input_codec(filename) != JSON_CODEC_NONE)
+        return parse_file_with(filename, process, h, ud);
+
+    json_mapping_t m;
+    if (!map_file(filename, &m))
+        return false;
+    if (!m.data)
+        return parse_file_with(filename, process, h, ud);
+
+    bool rc = parse_buffer(m.data, m.size, process, h, ud);
+    unmap_file(&m);
+    return rc;
+}
+
+/// @brief parse_mapped_with using the function pointer handlers in h
+bool parse_mapped_with_sax(const char *filename, const json_sax_handler_t *h, void *ud)
+{
+    return parse_mapped_with(filename, handler_engine(h), h, ud);
+}
+
+/// @brief Runs fn on every item of items, each on its own thread, and waits for them. Item 0 runs on the calling
+/// thread, as does any item whose thread can't be started.
+static void run_threads(json_thread_fn fn, void *items, size_t item_size, size_t count)
+{
+    char *base = items;
+    json_thread_t *threads = calloc(count, sizeof(*threads));
+    for (size_t i = 1; threads && i < count; ++i)
+        thread_start(&threads[i], fn, base + i * item_size);
+    fn(base);
+    for (size_t i = 1; i < count; ++i)
+    {
+        if (threads && threads[i].started)
+            thread_join(&threads[i]);
+        else
+            fn(base + i * item_size);
+    }
+    free(threads);
+}
+
+// Parallel JSON Lines. The mapping is cut into batches of about JSON_LINES_BATCH bytes, each moved forward to
+// the next line start, so every line belongs to exactly one batch. Workers claim batches off a shared counter
+// until there are none left, which keeps them busy even when the line lengths are uneven.
+#define JSON_LINES_BATCH (1024 * 1024)
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    size_t batch_count;
+    json_chunk_fn process;
+    const json_sax_handler_t *h;
+    volatile int64_t next_batch;
+    volatile int failed;
+} lines_job_t;
+
+typedef struct
+{
+    lines_job_t *job;
+    void *ud;
+    bool ok;
+} lines_worker_t;
+
+/// @brief Offset of batch k, the first line start at or after k * JSON_LINES_BATCH
+static size_t lines_batch_start(const lines_job_t *job, size_t k)
+{
+    if (k == 0)
+        return 0;
+    size_t at = k * JSON_LINES_BATCH;
+    if (at >= job->size)
+        return job->size;
+    size_t nl = find_newline(job->data, at - 1, job->size);
+    return nl < job->size ? nl + 1 : job->size;
+}
+
+static size_t lines_claim_batch(lines_job_t *job)
+{
+#if _MSC_VER
+    return (size_t)(InterlockedIncrement64((volatile LONG64 *)&job->next_batch) - 1);
+#else
+    return (size_t)__atomic_fetch_add(&job->next_batch, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/// @brief Stops the other workers early, any worker can call it
+static void lines_set_failed(lines_job_t *job)
+{
+#if _MSC_VER
+    InterlockedExchange((volatile LONG *)&job->failed, 1);
+#else
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static bool lines_failed(lines_job_t *job)
+{
+#if _MSC_VER
+    return InterlockedCompareExchange((volatile LONG *)&job->failed, 0, 0) != 0;
+#else
+    return __atomic_load_n(&job->failed, __ATOMIC_RELAXED) != 0;
+#endif
+}
+
+static JSON_THREAD_RETURN lines_worker(void *param)
+{
+    lines_worker_t *w = param;
+    lines_job_t *job = w->job;
+    json_sax_parser_t parser;
+    w->ok = parser_init(&parser, job->h, w->ud);
+    if (!w->ok)
+    {
+        lines_set_failed(job);
+        return 0;
+    }
+
+    while (!lines_failed(job))
+    {
+        size_t k = lines_claim_batch(job);
+        if (k >= job->batch_count)
+            break;
+        size_t start = lines_batch_start(job, k);
+        size_t end = lines_batch_start(job, k + 1);
+        reset_document(&parser);
+        parser.line_start = start;
+        parser.line_base = start;
+        if (!feed_lines(&parser, job->process, job->data + start, end - start, 1))
+        {
+            w->ok = false;
+            lines_set_failed(job);
+        }
+    }
+    parser_free(&parser);
+    return 0;
+}
+
+/// @brief parse_lines_parallel with the lines going through `process` instead of process_chunk
+static bool parse_lines_parallel_with(const char *filename, json_chunk_fn process, const json_sax_handler_t *h, void *const *worker_ud, size_t worker_count)
+{
+    if (worker_count == 0)
+        return false;
+    if (!filename || input_codec(filename) != JSON_CODEC_NONE)
+        return parse_lines_with(filename, process, h, worker_ud[0]);
+
+    json_mapping_t m;
+    if (!map_file(filename, &m))
+        return false;
+    if (!m.data)
+        return parse_lines_with(filename, process, h, worker_ud[0]);
+
+    TIME_BANDWIDTH(_s, "lines parallel", m.size);
+    lines_job_t job = {0};
+    job.data = m.data;
+    job.size = m.size;
+    job.batch_count = (m.size + JSON_LINES_BATCH - 1) / JSON_LINES_BATCH;
+    job.process = process;
+    json_sax_handler_t worker_h = {0};
+    if (h)
+        worker_h = *h;
+    worker_h.tape = NULL; // every worker allocates its own
+    job.h = &worker_h;
+
+    lines_worker_t *workers = calloc(worker_count, sizeof(*workers));
+    bool rc = workers != NULL;
+    if (rc)
+    {
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            workers[i].job = &job;
+            workers[i].ud = worker_ud[i];
+        }
+        run_threads(lines_worker, workers, sizeof(*workers), worker_count);
+        for (size_t i = 0; i < worker_count; ++i)
+            rc = rc && workers[i].ok;
+    }
+    else
+    {
+        fprintf(stderr, "alloc failure\n");
+    }
+    free(workers);
+    unmap_file(&m);
+    RETURN_VAL(_s, rc);
+}
+
+// Parallel parsing of one big array, such as the "pairs" in {"pairs": [...]}. The part up to and including the
+// '[' goes through the first worker's parser, which is then cloned into the others. The rest is cut into one
+// stripe per worker and scanned in parallel for the quote parity and bracket depth change of every stripe, the
+// same classification skip_nested does. Chaining those gives the exact string state and depth at each stripe
+// start, from where the first ',' directly inside the array is a safe place to split. Each worker then parses
+// its run of elements from there, picking up as if it had just read that ','.
+#ifndef JSON_PARALLEL_MIN_STRIPE
+#define JSON_PARALLEL_MIN_STRIPE (1024 * 1024)
+#endif
+
+typedef enum
+{
+    ARRAY_PHASE_SCAN,
+    ARRAY_PHASE_PARSE
+} array_phase_t;
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    size_t region; // first byte after the '['
+    size_t base_depth;
+    json_chunk_fn process;
+    array_phase_t phase;
+} array_job_t;
+
+typedef struct
+{
+    array_job_t *job;
+    json_sax_parser_t parser;
+
+    // Scan of the stripe, the depth change and the lowest depth relative to its start count brackets outside
+    // strings, for either string state at the start
+    size_t stripe_start;
+    size_t stripe_end;
+    uint64_t quotes;
+    int64_t depth_out;
+    int64_t depth_in;
+    int64_t min_out;
+    int64_t min_in;
+
+    // Run of elements to parse
+    size_t seg_start;
+    size_t seg_end;
+    bool run;
+    bool is_final;
+    bool ok;
+} array_worker_t;
+
+/// @brief Index just past the string starting at the '"' in buf[i], or len if it isn't closed
+static size_t string_end(const char *buf, size_t i, size_t len)
+{
+    for (++i; i < len; ++i)
+    {
+        if (buf[i] == '\\')
+            ++i;
+        else if (buf[i] == '"')
+            return i + 1;
+    }
+    return len;
+}
+
+/// @brief Index just past the value starting at buf[i], only as careful as finding its end requires
+static size_t value_end(const char *buf, size_t i, size_t len)
+{
+    if (i < len && buf[i] == '"')
+        return string_end(buf, i, len);
+    size_t depth = 0;
+    while (i < len)
+    {
+        char c = buf[i];
+        if (c == '"')
+        {
+            i = string_end(buf, i, len);
+            continue;
+        }
+        if (c == '{' || c == '[')
+            depth++;
+        else if (c == '}' || c == ']')
+        {
+            if (depth == 0)
+                return i;
+            if (--depth == 0)
+                return i + 1;
+        }
+        else if (depth == 0 && (c == ',' || iswhitespace(c)))
+            return i;
+        i++;
+    }
+    return len;
+}
+
+/// @brief Position of the '[' of the array at the dot separated key path, "" for a root array
+/// @return len if the path doesn't lead to an array
+static size_t find_array(const char *buf, size_t len, const char *path)
+{
+    size_t i = skip_whitespace(buf, 0, len);
+    while (*path)
+    {
+        size_t key_len = strcspn(path, ".");
+        if (i >= len || buf[i] != '{')
+            return len;
+        i++;
+        while (1)
+        {
+            i = skip_whitespace(buf, i, len);
+            if (i >= len || buf[i] != '"')
+                return len;
+            size_t key = i + 1;
+            i = string_end(buf, i, len);
+            if (i >= len)
+                return len;
+            bool match = i - 1 - key == key_len && memcmp(buf + key, path, key_len) == 0;
+            i = skip_whitespace(buf, i, len);
+            if (i >= len || buf[i] != ':')
+                return len;
+            i = skip_whitespace(buf, i + 1, len);
+            if (match)
+                break;
+            i = skip_whitespace(buf, value_end(buf, i, len), len);
+            if (i >= len || buf[i] != ',')
+                return len;
+            i++;
+        }
+        path += key_len;
+        if (*path == '.')
+            path++;
+    }
+    return i < len && buf[i] == '[' ? i : len;
+}
+
+/// @brief 1 if buf[i] is escaped, a backslash can only be escaped by another one so it's the parity of the run
+static uint64_t escaped_at(const char *buf, size_t from, size_t i)
+{
+    size_t b = i;
+    while (b > from && buf[b - 1] == '\\')
+        b--;
+    return (i - b) & 1;
+}
+
+/// @brief Adds the brackets of a block to depth, keeping track of the lowest depth reached. Only a block where
+/// the depth could go below the lowest so far is walked bit by bit.
+static inline void block_depth(uint64_t open, uint64_t close, int64_t *depth, int64_t *min_depth)
+{
+    if (*depth - (int64_t)popcount64(close) < *min_depth)
+    {
+        int64_t d = *depth;
+        for (uint64_t bits = open | close; bits; bits &= bits - 1)
+        {
+            d += (open & bits & (0 - bits)) ? 1 : -1;
+            if (d < *min_depth)
+                *min_depth = d;
+        }
+    }
+    *depth += (int64_t)popcount64(open) - (int64_t)popcount64(close);
+}
+
+static void scan_stripe(array_worker_t *w)
+{
+    const array_job_t *job = w->job;
+    uint64_t escaped = escaped_at(job->data, job->region, w->stripe_start);
+    uint64_t in_string = 0;
+    for (size_t i = w->stripe_start; i < w->stripe_end; i += 64)
+    {
+        const char *block = job->data + i;
+        char tail[64];
+        if (w->stripe_end - i < 64)
+        {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, w->stripe_end - i);
+            block = tail;
+        }
+        json_bracket_block_t b = classify_brackets(block);
+        uint64_t quote = b.quote & ~escaped_bits(b.backslash, &escaped);
+        uint64_t inside = prefix_xor(quote) ^ in_string;
+        in_string = (uint64_t)((int64_t)inside >> 63);
+        w->quotes += popcount64(quote);
+        block_depth(b.open & ~inside, b.close & ~inside, &w->depth_out, &w->min_out);
+        block_depth(b.open & inside, b.close & inside, &w->depth_in, &w->min_in);
+    }
+}
+
+/// @brief First element boundary at or after i, just past a ',' directly inside the array
+/// @param in_string, depth State at i, depth 1 is directly inside the array
+/// @return job->size if the array ends first
+static size_t find_split(const array_job_t *job, size_t i, bool in_string, int64_t depth)
+{
+    bool escaped = escaped_at(job->data, job->region, i);
+    for (; depth >= 1 && i < job->size; ++i)
+    {
+        char c = job->data[i];
+        if (in_string)
+        {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"')
+                in_string = false;
+        }
+        else if (c == '"')
+            in_string = true;
+        else if (c == '{' || c == '[')
+            depth++;
+        else if (c == '}' || c == ']')
+        {
+            if (--depth < 1)
+                break;
+        }
+        else if (c == ',' && depth == 1)
+            return i + 1;
+    }
+    return job->size;
+}
+
+static JSON_THREAD_RETURN array_worker(void *param)
+{
+    array_worker_t *w = param;
+    array_job_t *job = w->job;
+    if (job->phase == ARRAY_PHASE_SCAN)
+    {
+        scan_stripe(w);
+        return 0;
+    }
+
+    w->ok = true;
+    if (!w->run)
+        return 0;
+    json_sax_parser_t *p = &w->parser;
+    p->line_start = w->seg_start;
+    w->ok = job->process(p, job->data + w->seg_start, w->seg_end - w->seg_start, w->is_final);
+    if (w->ok && !w->is_final && (p->state != ST_ARRAY_ELEM || p->stack.len != job->base_depth))
+    {
+        call_error(p, "array element cut by a segment boundary");
+        w->ok = false;
+    }
+    return 0;
+}
+
+/// @brief Hands the array in job out to the workers, whose parsers are ready
+static bool parse_array(array_job_t *job, array_worker_t *workers, size_t worker_count, const char *array_path)
+{
+    json_sax_parser_t *first = &workers[0].parser;
+    size_t open = find_array(job->data, job->size, array_path ? array_path : "");
+    if (open == job->size)
+        return job->process(first, job->data, job->size, 1);
+
+    job->region = open + 1;
+    if (!job->process(first, job->data, job->region, 0))
+        return false;
+
+    // Too small to be worth sharing, or dropped by the projection
+    size_t span = job->size - job->region;
+    if (worker_count > span / JSON_PARALLEL_MIN_STRIPE)
+        worker_count = span / JSON_PARALLEL_MIN_STRIPE;
+    if (worker_count <= 1 || first->state != ST_ARRAY_ELEM)
+        return job->process(first, job->data + job->region, span, 1);
+
+    job->base_depth = first->stack.len;
+    for (size_t k = 1; k < worker_count; ++k)
+    {
+        json_sax_parser_t *p = &workers[k].parser;
+        for (size_t d = 0; d < first->stack.len; ++d)
+        {
+            if (!ctx_stack_push(&p->stack, first->stack.data[d], first->stack.path[d]))
+            {
+                call_error(p, "alloc failure");
+                return false;
+            }
+        }
+        p->state = ST_ARRAY_ELEM;
+        p->key_path = first->key_path;
+    }
+
+    job->phase = ARRAY_PHASE_SCAN;
+    for (size_t k = 0; k < worker_count; ++k)
+    {
+        workers[k].stripe_start = job->region + span / worker_count * k;
+        workers[k].stripe_end = k + 1 < worker_count ? job->region + span / worker_count * (k + 1) : job->size;
+    }
+    run_threads(array_worker, workers, sizeof(*workers), worker_count);
+
+    // Once the depth drops below 1 the array is over, the rest of the document goes to the last run
+    bool in_string = false;
+    bool closed = false;
+    int64_t depth = 1;
+    workers[0].seg_start = job->region;
+    for (size_t k = 1; k < worker_count; ++k)
+    {
+        const array_worker_t *prev = &workers[k - 1];
+        closed = closed || depth + (in_string ? prev->min_in : prev->min_out) < 1;
+        depth += in_string ? prev->depth_in : prev->depth_out;
+        in_string ^= prev->quotes & 1;
+        size_t split = closed ? job->size : find_split(job, workers[k].stripe_start, in_string, depth);
+        workers[k].seg_start = split > prev->seg_start ? split : prev->seg_start;
+    }
+
+    // The last run that isn't empty finishes the document
+    size_t last = 0;
+    for (size_t k = 0; k < worker_count; ++k)
+    {
+        workers[k].seg_end = k + 1 < worker_count ? workers[k + 1].seg_start : job->size;
+        if (workers[k].seg_start < job->size)
+            last = k;
+    }
+    for (size_t k = 0; k < worker_count; ++k)
+    {
+        workers[k].is_final = k == last;
+        workers[k].run = workers[k].seg_start < workers[k].seg_end || workers[k].is_final;
+    }
+
+    job->phase = ARRAY_PHASE_PARSE;
+    run_threads(array_worker, workers, sizeof(*workers), worker_count);
+    bool ok = true;
+    for (size_t k = 0; k < worker_count; ++k)
+        ok = ok && workers[k].ok;
+    return ok;
+}
+
+/// @brief parse_file_parallel with the chunks going through `process` instead of process_chunk
+static bool parse_file_parallel_with(const char *filename, json_chunk_fn process, const json_sax_handler_t *h, const char *array_path, void *const *worker_ud, size_t worker_count)
+{
+    if (worker_count == 0)
+        return false;
+    if (!filename || input_codec(filename) != JSON_CODEC_NONE)
+        return parse_file_with(filename, process, h, worker_ud[0]);
+
+    json_mapping_t m;
+    if (!map_file(filename, &m))
+        return false;
+    if (!m.data)
+        return parse_file_with(filename, process, h, worker_ud[0]);
+
+    TIME_BANDWIDTH(_s, "parse parallel", m.size);
+    array_worker_t *workers = calloc(worker_count, sizeof(*workers));
+    if (!workers)
+    {
+        fprintf(stderr, "alloc failure\n");
+        unmap_file(&m);
+        RETURN_VAL(_s, false);
+    }
+
+    array_job_t job = {0};
+    job.data = m.data;
+    job.size = m.size;
+    job.process = process;
+    json_sax_handler_t worker_h = {0};
+    if (h)
+        worker_h = *h;
+    worker_h.tape = NULL; // every worker allocates its own
+    size_t ready = 0;
+    while (ready < worker_count && parser_init(&workers[ready].parser, &worker_h, worker_ud[ready]))
+        workers[ready++].job = &job;
+
+    bool rc = ready == worker_count && parse_array(&job, workers, worker_count, array_path);
+    for (size_t i = 0; i < ready; ++i)
+        parser_free(&workers[i].parser);
+    free(workers);
+    unmap_file(&m);
+    RETURN_VAL(_s, rc);
+}
+
+bool parse_file_parallel(const char *filename, const json_sax_handler_t *h, const char *array_path, void *const *worker_ud, size_t worker_count)
+{
+    return parse_file_parallel_with(filename, handler_engine(h), h, array_path, worker_ud, worker_count);
+}
+
+bool parse_lines_with_sax(const char *filename, const json_sax_handler_t *h, void *ud)
+{
+    return parse_lines_with(filename, handler_engine(h), h, ud);
+}
+
+bool parse_lines_parallel(const char *filename, const json_sax_handler_t *h, void *const *worker_ud, size_t worker_count)
+{
+    return parse_lines_parallel_with(filename, handler_engine(h), h, worker_ud, worker_count);
+}
+
+json_sax_parser_t *json_sax_parser_create(const json_sax_handler_t *h, void *ud)
+{
+    json_sax_parser_t *parser = malloc(sizeof(*parser));
+    if (!parser)
+        return NULL;
+    if (!parser_init(parser, h, ud))
+    {
+        free(parser);
+        return NULL;
+    }
+    return parser;
+}
+
+void json_sax_parser_destroy(json_sax_parser_t *parser)
+{
+    if (!parser)
+        return;
+    parser_free(parser);
+    free(parser);
+}
+
+void json_sax_parser_reset(json_sax_parser_t *parser)
+{
+    reset_document(parser);
+    parser->line_start = 0;
+    parser->line_base = 0;
+}
+
+bool json_sax_feed(json_sax_parser_t *parser, const char *buf, size_t len, bool is_final)
+{
+    if (parser->state == ST_ERROR)
+        return false;
+    return handler_engine(&parser->handlers)(parser, buf, len, is_final);
+}
+
+bool json_sax_feed_lines(json_sax_parser_t *parser, const char *buf, size_t len, bool is_final)
+{
+    return feed_lines(parser, handler_engine(&parser->handlers), buf, len, is_final);
+}
+
+// Validation only. A stage 2 of its own over the structural index with the complete grammar: the engine merges
+// states where a missing ',' or ':' makes no difference to the events, the validator keeps them apart. Nothing
+// is decoded or emitted, strings are only scanned for escapes and control characters, and nesting is a bit per
+// open container. Reads go through the same sliding window as read_chunks, so a token is never cut.
+typedef enum
+{
+    VALIDATE_VALUE,         // document start, after ':' and after ',' in an array
+    VALIDATE_FIRST_ELEMENT, // after '[', a value or ']'
+    VALIDATE_FIRST_KEY,     // after '{', a key or '}'
+    VALIDATE_KEY,           // after ',' in an object
+    VALIDATE_COLON,         // after a key
+    VALIDATE_NEXT,          // after a value in a container, ',' or the closing bracket
+    VALIDATE_DONE           // after the root value, only whitespace may follow
+} validate_state_t;
+
+typedef struct
+{
+    validate_state_t state;
+    uint64_t *nesting; // a bit per open container, set for objects
+    size_t nesting_cap; // in bits
+    size_t depth;
+    size_t max_depth;
+    uint32_t *positions; // JSON_INDEX_WINDOW
+    size_t base;         // input offset of the current chunk
+    size_t consumed;     // bytes of the chunk done with, the rest starts a cut token
+    const char *error;
+    size_t error_pos;
+} json_validator_t;
+
+static bool validator_init(json_validator_t *v, size_t max_depth)
+{
+    memset(v, 0, sizeof(*v));
+    v->state = VALIDATE_VALUE;
+    v->max_depth = max_depth ? max_depth : SIZE_MAX;
+    v->nesting_cap = 64 * STACK_INIT;
+    v->nesting = malloc(v->nesting_cap / 8);
+    v->positions = malloc(sizeof(uint32_t) * JSON_INDEX_WINDOW);
+    return v->nesting && v->positions;
+}
+
+static void validator_free(json_validator_t *v)
+{
+    free(v->nesting);
+    free(v->positions);
+    v->nesting = NULL;
+    v->positions = NULL;
+}
+
+static bool validate_fail(json_validator_t *v, const char *msg, size_t pos)
+{
+    v->error = msg;
+    v->error_pos = v->base + pos;
+    return false;
+}
+
+static inline bool validate_in_object(const json_validator_t *v, size_t depth)
+{
+    size_t top = depth - 1;
+    return (v->nesting[top / 64] >> (top % 64)) & 1;
+}
+
+/// @brief Opens a container at depth, which the caller then increments
+static bool validate_push(json_validator_t *v, size_t depth, bool object)
+{
+    if (depth == v->nesting_cap)
+    {
+        uint64_t *n = realloc(v->nesting, v->nesting_cap / 4);
+        if (!n)
+            return false;
+        v->nesting = n;
+        v->nesting_cap *= 2;
+    }
+    uint64_t bit = 1ULL << (depth % 64);
+    if (object)
+        v->nesting[depth / 64] |= bit;
+    else
+        v->nesting[depth / 64] &= ~bit;
+    return true;
+}
+
+/// @brief What the validator was looking for when it found something else
+static const char *validate_expected(const json_validator_t *v, validate_state_t state, size_t depth)
+{
+    switch (state)
+    {
+    case VALIDATE_VALUE:
+        return "expected a value";
+    case VALIDATE_FIRST_ELEMENT:
+        return "expected a value or ']'";
+    case VALIDATE_FIRST_KEY:
+        return "expected an object key or '}'";
+    case VALIDATE_KEY:
+        return "expected an object key";
+    case VALIDATE_COLON:
+        return "expected ':'";
+    case VALIDATE_NEXT:
+        return validate_in_object(v, depth) ? "expected ',' or '}'" : "expected ',' or ']'";
+    default:
+        return "unexpected character after the end of the document";
+    }
+}
+
+/// @brief Index of the first '\\' or control character in buf[i, len), or len
+static inline size_t find_escape_or_control(const char *buf, size_t i, size_t len)
+{
+#if defined(__AVX2__)
+    while (i + 32 <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1f)), _mm256_set1_epi8(0x1f));
+        __m256i hit = _mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask)
+            return i + ctz32(mask);
+        i += 32;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f));
+        __m128i hit = _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask)
+            return i + ctz32(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && buf[i] != '\\' && (unsigned char)buf[i] >= 0x20)
+        i++;
+    return i;
+}
+
+/// @brief Value of the 4 hex digits at buf[i], or -1
+static inline int32_t validate_hex4(const char *buf, size_t i)
+{
+    int32_t value = 0;
+    for (size_t k = i; k < i + 4; ++k)
+    {
+        int d = hex_val(buf[k]);
+        if (d < 0)
+            return -1;
+        value = value << 4 | d;
+    }
+    return value;
+}
+
+/// @brief Checks the escapes and control characters of the string contents buf[i, end), end being the closing quote
+static bool validate_string_contents(json_validator_t *v, const char *buf, size_t i, size_t end)
+{
+    while ((i = find_escape_or_control(buf, i, end)) < end)
+    {
+        if (buf[i] != '\\')
+            return validate_fail(v, "control character in string", i);
+
+        // The closing quote is unescaped, so whatever is escaped lies before it
+        char c = buf[i + 1];
+        if (c != 'u')
+        {
+            if (c != '"' && c != '\\' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't')
+                return validate_fail(v, "invalid escape in string", i);
+            i += 2;
+            continue;
+        }
+        int32_t unit = i + 6 <= end ? validate_hex4(buf, i + 2) : -1;
+        if (unit < 0)
+            return validate_fail(v, "invalid \\u escape in string", i);
+        if (unit >= 0xdc00 && unit <= 0xdfff)
+            return validate_fail(v, "unpaired low surrogate", i);
+        if (unit >= 0xd800 && unit <= 0xdbff)
+        {
+            int32_t low = i + 12 <= end && buf[i + 6] == '\\' && buf[i + 7] == 'u' ? validate_hex4(buf, i + 8) : -1;
+            if (low < 0xdc00 || low > 0xdfff)
+                return validate_fail(v, "unpaired high surrogate", i);
+            i += 6;
+        }
+        i += 6;
+    }
+    return true;
+}
+
+#if JSON_VALIDATE_UTF8
+/// @brief Offset of the lead byte of the first sequence in s[0, len) that isn't valid UTF-8, including one cut
+/// short by the end of s
+static size_t utf8_error_offset(const unsigned char *s, size_t len)
+{
+    utf8_state_t state = {0};
+    size_t start = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (state.need == 0)
+            start = i;
+        if (!utf8_step(&state, s[i]))
+            return start;
+    }
+    return start;
+}
+#endif
+
+/// @brief End of the run of digits at buf[i, len), 8 at a time while they last
+static inline size_t digit_run(const char *buf, size_t i, size_t len)
+{
+    while (i + 8 <= len)
+    {
+        // Every byte a digit if the high nibble is 3 both before and after adding 6
+        uint64_t word;
+        memcpy(&word, buf + i, 8);
+        uint64_t check = (word & 0xf0f0f0f0f0f0f0f0ULL) | (((word + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4);
+        if (check != 0x3333333333333333ULL)
+            break;
+        i += 8;
+    }
+    while (i < len && buf[i] >= '0' && buf[i] <= '9')
+        i++;
+    return i;
+}
+
+/// @brief Follows the number grammar from buf[i]: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+/// @param end Set to the first byte that isn't part of the number, or the one that breaks the grammar
+/// @return False if the grammar breaks at end
+static inline bool validate_number(const char *buf, size_t i, size_t len, size_t *end)
+{
+    if (i < len && buf[i] == '-')
+        i++;
+    bool ok = true;
+    if (i < len && buf[i] == '0')
+        i++;
+    else if (i < len && buf[i] >= '1' && buf[i] <= '9')
+        i = digit_run(buf, i + 1, len);
+    else
+        ok = false;
+    if (ok && i < len && buf[i] == '.')
+    {
+        size_t digits = ++i;
+        i = digit_run(buf, i, len);
+        ok = i > digits;
+    }
+    if (ok && i < len && (buf[i] == 'e' || buf[i] == 'E'))
+    {
+        i++;
+        if (i < len && (buf[i] == '+' || buf[i] == '-'))
+            i++;
+        size_t digits = i;
+        i = digit_run(buf, i, len);
+        ok = i > digits;
+    }
+    *end = i;
+    return ok;
+}
+
+/// @brief Validates the next chunk of the document
+/// @param is_final Nonzero for the last chunk. Otherwise a token cut by the end of buf is left unconsumed, the
+/// next chunk has to start with buf[v->consumed, len)
+/// @return False at the first error, v->error and v->error_pos say what and where
+static bool validate_chunk(json_validator_t *v, const char *buf, size_t len, int is_final)
+{
+    TIME_BANDWIDTH(_s, __func__, len);
+    json_index_t ix = {0};
+    ix.buf = buf;
+    ix.len = len;
+    ix.positions = v->positions;
+    v->consumed = len;
+
+    // NOTE: Kept in locals, as fields of v every read of buf would have to reload them
+    validate_state_t state = v->state;
+    size_t depth = v->depth;
+#define VALIDATE_EXPECTED() validate_fail(v, validate_expected(v, state, depth), pos)
+#define VALIDATE_HOLD()        \
+    do                         \
+    {                          \
+        v->state = state;      \
+        v->depth = depth;      \
+        v->consumed = pos;     \
+        RETURN_VAL(_s, true);  \
+    } while (0)
+
+    size_t pos;
+    while (index_peek(&ix, &pos))
+    {
+        ix.at++;
+        char c = buf[pos];
+        bool accepts_value = state == VALIDATE_VALUE || state == VALIDATE_FIRST_ELEMENT;
+        switch (c)
+        {
+        case '{':
+        case '[':
+        {
+            if (!accepts_value)
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            if (depth == v->max_depth)
+                RETURN_VAL(_s, validate_fail(v, "nesting too deep", pos));
+            if (!validate_push(v, depth, c == '{'))
+                RETURN_VAL(_s, validate_fail(v, "alloc failure", pos));
+            depth++;
+            state = c == '{' ? VALIDATE_FIRST_KEY : VALIDATE_FIRST_ELEMENT;
+            continue;
+        }
+        case '}':
+        case ']':
+        {
+            bool object = c == '}';
+            bool empty = state == (object ? VALIDATE_FIRST_KEY : VALIDATE_FIRST_ELEMENT);
+            if (!empty && !(state == VALIDATE_NEXT && validate_in_object(v, depth) == object))
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            depth--;
         }
         break;
-        case ST_STRING_ESC:
+        case ',':
         {
-            if (c == '"' || c == '\\' || c == '/')
-            {
-                if (!sbuf_append_char(&parser->strbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 'b')
-            {
-                if (!sbuf_append_char(&parser->strbuf, '\b'))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 'f')
-            {
-                if (!sbuf_append_char(&parser->strbuf, '\f'))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 'n')
-            {
-                if (!sbuf_append_char(&parser->strbuf, '\n'))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 'r')
-            {
-                if (!sbuf_append_char(&parser->strbuf, '\r'))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 't')
-            {
-                if (!sbuf_append_char(&parser->strbuf, '\t'))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                parser->state = ST_STRING;
-                i++;
-                continue;
-            }
-            else if (c == 'u')
-            {
-                parser->u_remaining = 4;
-                parser->u_value = 0;
-                parser->state = ST_STRING;
-                // parse \uXXXX (4 hex digits)
-                i++;
-                // Loop to process this hex code is after the switch
-            }
-            else
-            {
-                call_error(parser, "invalid escape in string");
-                return false;
-            }
+            if (state != VALIDATE_NEXT)
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            state = validate_in_object(v, depth) ? VALIDATE_KEY : VALIDATE_VALUE;
+            continue;
         }
-        break;
-        case ST_NUMBER:
+        case ':':
         {
-            if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.' || c == 'e' || c == 'E')
-            {
-                if (!sbuf_append_char(&parser->numbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                    return false;
-                }
-                i++;
-                continue;
-            }
-            else
-            {
-                emit_number(parser);
-                ctx_type_t top = ctx_stack_top(&parser->stack);
-                if (top == CTX_ARRAY)
-                    parser->state = ST_ARRAY_ELEM;
-                else if (top == CTX_OBJECT)
-                    parser->state = ST_AFTER_COLON;
-                else
-                    parser->state = ST_DONE;
-                continue;
-            }
+            if (state != VALIDATE_COLON)
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            state = VALIDATE_VALUE;
+            continue;
         }
-        break;
-        case ST_TRUE:
+        case '"':
         {
-            const char *match = "rue";
-            size_t have = parser->numbuf.len;
-            if (have == 0)
-            {
-                call_error(parser, "internal true parser error");
-                return false;
-            }
-            size_t expect_index = have - 1;
-            if (expect_index >= 3)
-            {
-                call_error(parser, "internal true length error");
-                return false;
-            }
+            bool key = state == VALIDATE_FIRST_KEY || state == VALIDATE_KEY;
+            if (!key && !accepts_value)
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
 
-            if (c == match[expect_index])
+            // Inside a string nothing but the closing quote makes it into the index
+            size_t close;
+            if (!index_peek(&ix, &close))
             {
-                if (!sbuf_append_char(&parser->numbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                i++;
-                if (parser->numbuf.len == 4)
-                {
-                    if (parser->handlers.boolean)
-                        parser->handlers.boolean(parser->user_data, true);
-                    parser->numbuf.len = 0;
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    if (top == CTX_ARRAY)
-                        parser->state = ST_ARRAY_ELEM;
-                    else if (top == CTX_OBJECT)
-                        parser->state = ST_AFTER_COLON;
-                    else
-                        parser->state = ST_DONE;
-                }
-                continue;
+                if (!is_final)
+                    VALIDATE_HOLD();
+                RETURN_VAL(_s, validate_fail(v, "unterminated string", len));
             }
-            else
+            ix.at++;
+            if (!validate_string_contents(v, buf, pos + 1, close))
+                RETURN_VAL(_s, false);
+#if JSON_VALIDATE_UTF8
+            const unsigned char *str = (const unsigned char *)buf + pos + 1;
+            if (!index_utf8_valid(&ix, pos + 1, close + 1) && !utf8_valid(str, close - pos - 1))
+                RETURN_VAL(_s, validate_fail(v, "invalid UTF-8 in string", pos + 1 + utf8_error_offset(str, close - pos - 1)));
+#endif
+            if (key)
             {
-                call_error(parser, "invalid token while parsing 'true'");
-                return false;
+                state = VALIDATE_COLON;
+                continue;
             }
         }
         break;
-        case ST_FALSE:
+        case 't':
+        case 'f':
+        case 'n':
         {
-            const char *match = "alse";
-            size_t have = parser->numbuf.len;
-            if (have == 0)
-            {
-                call_error(parser, "internal true parser error");
-                return false;
-            }
-            size_t expect_index = have - 1;
-            if (expect_index >= 4)
-            {
-                call_error(parser, "internal true length error");
-                return false;
-            }
-
-            if (c == match[expect_index])
-            {
-                if (!sbuf_append_char(&parser->numbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                i++;
-                if (parser->numbuf.len == 5)
-                {
-                    if (parser->handlers.boolean)
-                        parser->handlers.boolean(parser->user_data, false);
-                    parser->numbuf.len = 0;
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    if (top == CTX_ARRAY)
-                        parser->state = ST_ARRAY_ELEM;
-                    else if (top == CTX_OBJECT)
-                        parser->state = ST_AFTER_COLON;
-                    else
-                        parser->state = ST_DONE;
-                }
-                continue;
-            }
-            else
-            {
-                call_error(parser, "invalid token while parsing 'true'");
-                return false;
-            }
+            if (!accepts_value)
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            const char *word = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+            size_t word_len = (c == 'f') ? 5 : 4;
+            if (len - pos < word_len && !is_final && memcmp(buf + pos, word, len - pos) == 0)
+                VALIDATE_HOLD();
+            if (len - pos < word_len || memcmp(buf + pos, word, word_len) != 0 || !token_ends_at(buf, pos + word_len, len))
+                RETURN_VAL(_s, validate_fail(v, "invalid literal", pos));
         }
         break;
-        case ST_NULL:
+        default:
         {
-            const char *match = "ull";
-            size_t have = parser->numbuf.len;
-            if (have == 0)
-            {
-                call_error(parser, "internal true parser error");
-                return false;
-            }
-            size_t expect_index = have - 1;
-            if (expect_index >= 3)
-            {
-                call_error(parser, "internal true length error");
-                return false;
-            }
-
-            if (c == match[expect_index])
-            {
-                if (!sbuf_append_char(&parser->numbuf, c))
-                {
-                    call_error(parser, "alloc failure");
-                }
-                i++;
-                if (parser->numbuf.len == 4)
-                {
-                    if (parser->handlers.boolean)
-                        parser->handlers.boolean(parser->user_data, true);
-                    parser->numbuf.len = 0;
-                    ctx_type_t top = ctx_stack_top(&parser->stack);
-                    if (top == CTX_ARRAY)
-                        parser->state = ST_ARRAY_ELEM;
-                    else if (top == CTX_OBJECT)
-                        parser->state = ST_AFTER_COLON;
-                    else
-                        parser->state = ST_DONE;
-                }
-                continue;
-            }
-            else
-            {
-                call_error(parser, "invalid token while parsing 'true'");
-                return false;
-            }
+            if (!accepts_value || (c != '-' && !(c >= '0' && c <= '9')))
+                RETURN_VAL(_s, VALIDATE_EXPECTED());
+            size_t end;
+            bool ok = validate_number(buf, pos, len, &end);
+            if (end == len && !is_final)
+                VALIDATE_HOLD();
+            if (!ok || !token_ends_at(buf, end, len))
+                RETURN_VAL(_s, validate_fail(v, "invalid number", pos));
         }
         break;
-        default:
-            call_error(parser, "unexpected parser state");
-            return false;
         }
 
-        // parse \uXXXX
-        if (parser->u_remaining > 0 && parser->state == ST_STRING)
+        // A value just ended
+        state = depth ? VALIDATE_NEXT : VALIDATE_DONE;
+    }
+#undef VALIDATE_EXPECTED
+#undef VALIDATE_HOLD
+
+    v->state = state;
+    v->depth = depth;
+    if (is_final && state != VALIDATE_DONE)
+        RETURN_VAL(_s, validate_fail(v, "unexpected end of input", len));
+    RETURN_VAL(_s, true);
+}
+
+/// @brief Validates f to the end through a sliding window like read_chunks
+static bool validate_stream(json_validator_t *v, FILE *f)
+{
+    size_t cap = READ_BUF_SIZE;
+    char *buf = malloc(cap);
+    if (!buf)
+        return validate_fail(v, "alloc failure", 0);
+    size_t kept = 0;
+    bool ok = true;
+    while (ok)
+    {
+        if (kept == cap)
         {
-            int needed = parser->u_remaining;
-            size_t j = i;
-            while (needed > 0 && j < (int)buflen)
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
             {
-                int v = hex_val(buf[j]);
-                if (v < 0)
-                {
-                    call_error(parser, "invalid hex in \\u espace");
-                    return false;
-                }
-                parser->u_value = (uint16_t)((parser->u_value << 4) | (uint16_t)v);
-                needed--;
-                j++;
-                parser->position++;
+                ok = validate_fail(v, "alloc failure", kept);
+                break;
             }
-            size_t consumed = j - (int)i;
-            i += consumed;
-            parser->u_remaining = needed;
-            if (parser->u_remaining == 0)
-            {
-                uint16_t cu = parser->u_value;
-                parser->u_value = 0;
-                // handle surrogate pairs
-                if (0xd800 <= cu && cu <= 0xdbff)
-                {
-                    // high surrogate
-                    parser->expecting_surrogate = 1;
-                    parser->u_remaining = 0;
+            buf = grown;
+            cap *= 2;
+        }
 
-                    parser->u_value = cu;
-                    // this can fail across chunk boundries
-                }
-                else if (0xdc00 <= cu && cu <= 0xdfff)
-                {
-                    // low surrogate
-                    call_error(parser, "unexpected low surrogate");
-                    return false;
-                }
-                else
-                {
-                    if (!sbuf_append_utf8_codepoint(&parser->strbuf, (uint32_t)cu))
-                    {
-                        call_error(parser, "alloc failure");
-                        return false;
-                    }
-                }
-            }
+        TIME_BANDWIDTH(_f, "fread", cap - kept);
+        size_t n = fread(buf + kept, 1, cap - kept, f);
+        if (ferror(f))
+        {
+            ok = validate_fail(v, "read error", kept);
+            END_SCOPE(_f);
+            break;
         }
+        int is_final = feof(f);
+        size_t avail = kept + n;
+        ok = validate_chunk(v, buf, avail, is_final);
+        END_SCOPE(_f);
+        if (is_final)
+            break;
+        kept = avail - v->consumed;
+        memmove(buf, buf + v->consumed, kept);
+        v->base += v->consumed;
+    }
+    free(buf);
+    return ok;
+}
+
+static bool validate_result(json_validator_t *v, bool ok, json_validate_result_t *result)
+{
+    if (result)
+    {
+        result->error = ok ? NULL : v->error;
+        result->pos = ok ? 0 : v->error_pos;
+    }
+    validator_free(v);
+    return ok;
+}
+
+bool json_validate(const char *buf, size_t len, size_t max_depth, json_validate_result_t *result)
+{
+    json_validator_t v;
+    if (!validator_init(&v, max_depth))
+    {
+        v.error = "alloc failure";
+        return validate_result(&v, false, result);
+    }
+    return validate_result(&v, validate_chunk(&v, buf, len, 1), result);
+}
+
+bool json_validate_file(const char *filename, size_t max_depth, json_validate_result_t *result)
+{
+    json_validator_t v;
+    if (!validator_init(&v, max_depth))
+    {
+        v.error = "alloc failure";
+        return validate_result(&v, false, result);
     }
 
-    if (is_final)
+    // A mapped file is one chunk, only stdin and files that can't be mapped are read
+    json_mapping_t m = {0};
+    if (filename && !map_file(filename, &m))
     {
-        if (parser->state == ST_DONE || parser->stack.len == 0)
+        v.error = "can't open the file";
+        return validate_result(&v, false, result);
+    }
+    bool ok;
+    if (m.data)
+    {
+        ok = validate_chunk(&v, m.data, m.size, 1);
+        unmap_file(&m);
+    }
+    else
+    {
+        FILE *f = filename ? fopen(filename, "rb") : stdin;
+        if (!f)
         {
-            return true;
+            perror("fopen");
+            v.error = "can't open the file";
+            return validate_result(&v, false, result);
         }
-        else
+        ok = validate_stream(&v, f);
+        if (f != stdin)
+            fclose(f);
+    }
+    return validate_result(&v, ok, result);
+}
+
+// Pull cursor. The engine is instantiated with handlers that append to an event queue, json_next_event feeds
+// the parser one slice of input whenever the queue runs dry and hands the queued events out one at a time.
+// Keys, strings and numbers that sit whole in the input point straight into it, only the ones the engine had
+// to assemble (escapes, split across slices) are copied.
+#define JSON_CURSOR_SLICE (64 * 1024)
+#define JSON_CURSOR_QUEUE_INIT 1024
+
+typedef struct
+{
+    json_event_t event;
+    size_t text_at; // 1 + offset into the cursor's text buffer when the text was copied, 0 otherwise
+} json_cursor_slot_t;
+
+struct json_cursor
+{
+    json_sax_parser_t parser;
+    FILE *f;
+    char *readbuf; // READ_BUF_SIZE, file cursors only
+
+    // Input the parser is working through, the last chunk read from f or the whole caller buffer
+    const char *data;
+    size_t len;
+    size_t fed;
+    bool eof; // data is the end of the input
+    bool done;
+    const char *error;
+
+    json_cursor_slot_t *slots;
+    size_t head;
+    size_t count;
+    size_t cap;
+    json_cursor_slot_t overflow; // written to instead when the queue can't grow
+    sbuf_t text;
+};
+
+static inline json_cursor_slot_t *cursor_push(json_cursor_t *c, json_event_type_t type)
+{
+    if (c->count == c->cap)
+    {
+        size_t ncap = c->cap * 2;
+        json_cursor_slot_t *n = realloc(c->slots, sizeof(json_cursor_slot_t) * ncap);
+        if (!n)
         {
-            call_error(parser, "unexpected end of input");
-            return false;
+            c->error = "alloc failure";
+            return &c->overflow;
         }
+        c->slots = n;
+        c->cap = ncap;
     }
-
-    return true;
+    json_cursor_slot_t *slot = &c->slots[c->count++];
+    slot->event.type = type;
+    slot->text_at = 0;
+    return slot;
 }
 
-bool json_sax_parse_file(json_sax_parser_t *parser, FILE *f){
-    char buf[READ_BUF_SIZE];
-    while(1){
-        size_t n = fread(buf,1,READ_BUF_SIZE,f);
-        if(ferror(f)){
-            call_error(parser, "read error");
-            return false;
-        }
-        int is_final = feof(f);
-        if(!process_chunk(parser, buf, n, is_final)) return false;
-        if(is_final) break;
+static inline void cursor_push_text(json_cursor_t *c, json_event_type_t type, const char *s, size_t n)
+{
+    json_cursor_slot_t *slot = cursor_push(c, type);
+    slot->event.len = n;
+    if ((uintptr_t)s >= (uintptr_t)c->data && (uintptr_t)s < (uintptr_t)(c->data + c->len))
+    {
+        slot->event.text = s;
+        return;
     }
+    // In the parser's own buffers, which the next token overwrites
+    slot->text_at = c->text.len + 1;
+    if (!sbuf_append_bytes(&c->text, s, n))
+        c->error = "alloc failure";
+}
 
-    return true;
+static void cursor_on_start_object(void *ud)
+{
+    cursor_push(ud, JSON_EVENT_START_OBJECT);
+}
+static void cursor_on_end_object(void *ud)
+{
+    cursor_push(ud, JSON_EVENT_END_OBJECT);
+}
+static void cursor_on_start_array(void *ud)
+{
+    cursor_push(ud, JSON_EVENT_START_ARRAY);
+}
+static void cursor_on_end_array(void *ud)
+{
+    cursor_push(ud, JSON_EVENT_END_ARRAY);
+}
+static void cursor_on_null(void *ud)
+{
+    cursor_push(ud, JSON_EVENT_NULL);
 }
 
-bool parse_file_with_sax(const char *filename, const json_sax_handler_t *h, void *ud){
-    FILE *f = NULL;
-    if(!filename)  f = stdin;
-    else {
+static void cursor_on_key(void *ud, const char *key, size_t len)
+{
+    cursor_push_text(ud, JSON_EVENT_KEY, key, len);
+}
+
+static void cursor_on_string(void *ud, const char *value, size_t len)
+{
+    cursor_push_text(ud, JSON_EVENT_STRING, value, len);
+}
+
+static void cursor_on_number(void *ud, const char *num_text, size_t len)
+{
+    cursor_push_text(ud, JSON_EVENT_NUMBER, num_text, len);
+}
+
+static void cursor_on_boolean(void *ud, bool value)
+{
+    cursor_push(ud, JSON_EVENT_BOOLEAN)->event.boolean = value;
+}
+
+static void cursor_on_error(void *ud, const char *msg, size_t pos)
+{
+    (void)pos;
+    json_cursor_t *c = ud;
+    if (!c->error)
+        c->error = msg;
+}
+
+#define JSON_SAX_PREFIX cursor_
+#define JSON_SAX_STATIC
+#define JSON_SAX_ON_START_OBJECT cursor_on_start_object
+#define JSON_SAX_ON_END_OBJECT cursor_on_end_object
+#define JSON_SAX_ON_START_ARRAY cursor_on_start_array
+#define JSON_SAX_ON_END_ARRAY cursor_on_end_array
+#define JSON_SAX_ON_KEY cursor_on_key
+#define JSON_SAX_ON_STRING cursor_on_string
+#define JSON_SAX_ON_NUMBER cursor_on_number
+#define JSON_SAX_ON_BOOLEAN cursor_on_boolean
+#define JSON_SAX_ON_NULL cursor_on_null
+#include "sax_json_engine.h"
+
+static json_cursor_t *cursor_create(void)
+{
+    json_cursor_t *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    json_sax_handler_t h = {0};
+    h.error = cursor_on_error;
+    c->cap = JSON_CURSOR_QUEUE_INIT;
+    c->slots = malloc(sizeof(json_cursor_slot_t) * c->cap);
+    if (!c->slots)
+    {
+        free(c);
+        return NULL;
+    }
+    if (!sbuf_init(&c->text, STRING_BUF_INIT))
+    {
+        free(c->slots);
+        free(c);
+        return NULL;
+    }
+    if (!parser_init(&c->parser, &h, c))
+    {
+        sbuf_free(&c->text);
+        free(c->slots);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+json_cursor_t *json_cursor_open_file(const char *filename)
+{
+    FILE *f = stdin;
+    if (filename)
+    {
         f = fopen(filename, "rb");
-        if(!f){
+        if (!f)
+        {
             perror("fopen");
+            return NULL;
+        }
+    }
+    json_cursor_t *c = cursor_create();
+    char *readbuf = c ? malloc(READ_BUF_SIZE) : NULL;
+    if (!readbuf)
+    {
+        json_cursor_close(c);
+        if (f != stdin)
+            fclose(f);
+        return NULL;
+    }
+    c->f = f;
+    c->readbuf = readbuf;
+    c->data = readbuf;
+    return c;
+}
+
+json_cursor_t *json_cursor_open_buffer(const char *buf, size_t len)
+{
+    json_cursor_t *c = cursor_create();
+    if (!c)
+        return NULL;
+    c->data = buf;
+    c->len = len;
+    c->eof = true;
+    return c;
+}
+
+void json_cursor_close(json_cursor_t *cursor)
+{
+    if (!cursor)
+        return;
+    parser_free(&cursor->parser);
+    sbuf_free(&cursor->text);
+    free(cursor->slots);
+    free(cursor->readbuf);
+    if (cursor->f && cursor->f != stdin)
+        fclose(cursor->f);
+    free(cursor);
+}
+
+/// @brief Feeds slices of input until the parser has produced at least one event or the input is used up
+static bool cursor_refill(json_cursor_t *c)
+{
+    // The events handed out so far, and the text they point at, are no longer needed
+    c->head = c->count = 0;
+    c->text.len = 0;
+    while (c->count == 0)
+    {
+        if (c->done || c->error)
             return false;
+        if (c->fed == c->len && !c->eof)
+        {
+            size_t n = fread(c->readbuf, 1, READ_BUF_SIZE, c->f);
+            if (ferror(c->f))
+            {
+                c->error = "read error";
+                return false;
+            }
+            c->eof = feof(c->f) != 0;
+            c->len = n;
+            c->fed = 0;
         }
+
+        size_t n = c->len - c->fed;
+        if (n > JSON_CURSOR_SLICE)
+            n = JSON_CURSOR_SLICE;
+        bool last = c->eof && c->fed + n == c->len;
+        bool ok = cursor_process_chunk(&c->parser, c->data + c->fed, n, last);
+        c->fed += n;
+        if (last)
+            c->done = true;
+        if (!ok && !c->error)
+            c->error = "parse error";
     }
-    json_sax_parser_t parser;
-    if(!parser_init(&parser, h, ud)){
-        if(f&& f != stdin) fclose(f);
+    // Events queued before an error are still handed out, the error is reported after them
+    return true;
+}
+
+bool json_next_event(json_cursor_t *cursor, json_event_t *event)
+{
+    if (cursor->head == cursor->count && !cursor_refill(cursor))
         return false;
-    }
-    bool rc = json_sax_parse_file(&parser, f);
-    parser_free(&parser);
-    if(f && f != stdin) fclose(f);
-    return rc;
+    const json_cursor_slot_t *slot = &cursor->slots[cursor->head++];
+    *event = slot->event;
+    if (slot->text_at)
+        event->text = cursor->text.buf + slot->text_at - 1;
+    return true;
+}
+
+const char *json_cursor_error(const json_cursor_t *cursor)
+{
+    return cursor->error;
 }
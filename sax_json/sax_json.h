@@ -1,28 +1,204 @@
 #ifndef SAX_JSON_H
 #define SAX_JSON_H
 
+#include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
+// Expected shape of the records in an array, e.g. every element of "pairs" is {"x0":n, "y0":n, "x1":n, "y1":n}.
+// Objects inside arrays that match it byte for byte (keys in order, number values, any whitespace) are parsed
+// in one tight loop and delivered as a single record callback instead of start_object/key/number/end_object.
+// Anything else, including a record cut by a chunk boundary, goes through the generic state machine.
+#define JSON_RECORD_MAX_FIELDS 8
+
+typedef struct
+{
+    const char *keys[JSON_RECORD_MAX_FIELDS]; // expected keys, in order
+    size_t field_count;
+    double (*parse_number)(const char *num_text, size_t len); // NULL uses json_atof
+    void (*record)(void *ud, const double *values);
+} json_record_shape_t;
+
+#define JSON_PATH_MAX_KEYS 63
+
+// Event types of the pull API and the batched tape
+typedef enum
+{
+    JSON_EVENT_START_OBJECT,
+    JSON_EVENT_END_OBJECT,
+    JSON_EVENT_START_ARRAY,
+    JSON_EVENT_END_ARRAY,
+    JSON_EVENT_KEY,
+    JSON_EVENT_STRING,
+    JSON_EVENT_NUMBER,
+    JSON_EVENT_BOOLEAN,
+    JSON_EVENT_NULL
+} json_event_type_t;
+
+// One event on the tape of the batched handler, fixed size so the consumer can run over a batch in a tight loop
+typedef struct
+{
+    json_event_type_t type;
+    // Key and string contents (unescaped) or the number text, NULL for the other events. Not null terminated,
+    // valid until on_batch returns.
+    const char *text;
+    size_t len;
+    double number; // JSON_EVENT_NUMBER exactly rounded, 1 or 0 for JSON_EVENT_BOOLEAN
+} json_tape_event_t;
+
+
 typedef struct
 {
     void (*start_object)(void *ud);
     void (*end_object)(void *ud);
     void (*start_array)(void *ud);
     void (*end_array)(void *ud);
-    void (*key)(void *ud, const char *key);
-    void (*string)(void *ud, const char *value);
+    void (*key)(void *ud, const char *key, size_t len);
+    void (*string)(void *ud, const char *value, size_t len);
     void (*number)(void *ud, const char *num_text, size_t len);
+    // Optional, numbers converted by the engine instead of handed over as text. An integer that fits goes to
+    // int64_value when it's set, everything else to double_value (exactly rounded). Only numbers neither of
+    // them takes are passed to number.
+    void (*double_value)(void *ud, double value);
+    void (*int64_value)(void *ud, int64_t value);
     void (*boolean)(void *ud, bool boolean_value);
     void (*null_value)(void *ud);
     void (*error)(void *ud, const char *msg, size_t pos);
+    const json_record_shape_t *record_shape; // optional
+
+    // Optional projection, dot separated keys from the root such as "pairs" or "meta.source.name". Everything
+    // under a path is delivered, along with the containers and keys leading to it. A key that leads to none of
+    // the paths is dropped together with its value, which is skipped without events, decoding or allocation.
+    // Array elements are matched like the value holding the array. At most JSON_PATH_MAX_KEYS keys over all
+    // paths, the strings have to outlive the parser.
+    const char *const *paths;
+    size_t path_count;
+
+    // Optional batched delivery. When on_batch is set the events are written to the tape instead of going to the
+    // callbacks above (error still is called, record_shape isn't used) and on_batch gets them when the tape is
+    // full, at the end of every chunk and before an error. A string that had to be unescaped or was split across
+    // chunks ends its batch early. tape holds tape_capacity events, NULL or 0 has the parser allocate one of
+    // JSON_TAPE_EVENTS (4096). The parallel functions give every worker a tape of its own.
+    void (*on_batch)(void *ud, const json_tape_event_t *events, size_t count);
+    json_tape_event_t *tape;
+    size_t tape_capacity;
 } json_sax_handler_t;
 
-/// @brief 
-/// @param filename The file to parse. If filename is NULL, defaults to stdin
+typedef struct json_sax_parser json_sax_parser_t;
+
+/// @brief
+/// @param filename The file to parse. If filename is NULL, defaults to stdin. Files named *.gz or *.zst are
+/// decompressed on a second thread while they're parsed, given a build with JSON_SAX_GZIP or JSON_SAX_ZSTD.
 /// @param h SAX callback handlers
 /// @param ud User Data struct that is passed to the handlers
 /// @return True if parsing completed successfully. False on any error
 bool parse_file_with_sax(const char *filename, const json_sax_handler_t *h, void *ud);
 
+/// @brief Same as parse_file_with_sax but maps the whole file into memory instead of reading it in chunks
+bool parse_mapped_with_sax(const char *filename, const json_sax_handler_t *h, void *ud);
+
+/// @brief Parses a file that is mostly one big array, such as {"pairs": [...]}, on up to worker_count threads.
+/// The array is cut into one run of elements per worker, each parsed by its own parser and handed its own user
+/// data, worker_ud[i], so the handlers mustn't touch shared state. Every worker sees its part of the document in
+/// order: worker_ud[0] everything up to the end of the first run, worker_ud[i] the i-th run, and the last one the
+/// rest of the document, so going through worker_ud in index order gives the results in document order.
+/// Runs are at least a megabyte, a smaller array leaves the later workers without events. Falls back to
+/// worker_ud[0] alone for stdin, compressed files, files that can't be mapped and when array_path doesn't lead
+/// to an array.
+/// Errors report the byte offset the failing worker's run starts at as pos.
+/// @param array_path Dot separated keys leading to the array, like the projection paths. NULL or "" for a root array
+bool parse_file_parallel(const char *filename, const json_sax_handler_t *h, const char *array_path, void *const *worker_ud, size_t worker_count);
+
+// JSON Lines (NDJSON), one document per line, e.g. one record per line in a log. Each line is parsed on its own
+// with the same handlers, blank lines are skipped. An error stops the whole input and is reported with the byte
+// offset of the line it's in as pos.
+
+/// @brief JSON Lines version of parse_file_with_sax, reads in chunks so it works on pipes, stdin and compressed
+/// files too
+bool parse_lines_with_sax(const char *filename, const json_sax_handler_t *h, void *ud);
+
+/// @brief JSON Lines spread over worker_count threads, each with its own parser and handed its own user data,
+/// worker_ud[i]. A worker always sees whole lines, but which worker gets a line and in what order across workers
+/// is unspecified, so the handlers shouldn't touch shared state and results are combined from worker_ud after
+/// this returns. Runs everything on worker_ud[0] for stdin, compressed files and files that can't be mapped.
+/// @param worker_count Threads to use including the calling one, at least 1
+bool parse_lines_parallel(const char *filename, const json_sax_handler_t *h, void *const *worker_ud, size_t worker_count);
+
+/// @brief Parser for feeding a document in pieces from wherever it comes from (sockets, pipes, own buffers)
+/// @param h SAX callback handlers, copied
+/// @param ud User Data struct that is passed to the handlers
+/// @return NULL on allocation failure
+json_sax_parser_t *json_sax_parser_create(const json_sax_handler_t *h, void *ud);
+void json_sax_parser_destroy(json_sax_parser_t *parser);
+
+/// @brief Gets the parser ready for the next document, keeping its handlers and buffers
+void json_sax_parser_reset(json_sax_parser_t *parser);
+
+/// @brief Pushes the next piece of the document through the parser, calling the handlers as it goes.
+/// Tokens may be split across pieces at any byte. buf is no longer referenced once this returns.
+/// @param is_final True for the last piece, the document has to be complete at its end
+/// @return False on a parse error, the error handler has already been called. Every later feed fails too
+/// until the parser is reset.
+bool json_sax_feed(json_sax_parser_t *parser, const char *buf, size_t len, bool is_final);
+
+/// @brief json_sax_feed for JSON Lines, the pieces may split lines anywhere. Once one line fails every later
+/// feed fails too until the parser is reset.
+bool json_sax_feed_lines(json_sax_parser_t *parser, const char *buf, size_t len, bool is_final);
+
+/// @brief Reads f to the end and feeds it to the parser
+bool json_sax_parse_file(json_sax_parser_t *parser, FILE *f);
+
+// Validation only, for checking a file is well-formed without parsing it for anything. Grammar, nesting depth and
+// UTF-8 (unless built without JSON_VALIDATE_UTF8) are checked without any events. Stricter than the SAX
+// functions, which let some malformed input through where it makes no difference to the events, a missing ','
+// between array elements for one. Lone surrogates in \u escapes are rejected.
+typedef struct
+{
+    const char *error; // NULL for a well-formed document
+    size_t pos;        // byte offset of the first error
+} json_validate_result_t;
+
+/// @brief Checks that buf[0, len) is exactly one well-formed JSON document
+/// @param max_depth Deepest nesting of objects and arrays allowed, 0 for no limit
+/// @param result Where the first error is, may be NULL
+bool json_validate(const char *buf, size_t len, size_t max_depth, json_validate_result_t *result);
+
+/// @brief json_validate for a file, mapped when it can be and read through a sliding window otherwise
+/// @param filename The file to check. If filename is NULL, defaults to stdin
+bool json_validate_file(const char *filename, size_t max_depth, json_validate_result_t *result);
+
+/// @brief Exactly rounded text to double, e.g. for the number events
+double json_atof(const char *num_text, size_t len);
+
+// Pull API, the consumer asks for the next event instead of being called back
+typedef struct
+{
+    json_event_type_t type;
+    // Key and string contents (unescaped) or the number text. Not null terminated, valid until the next
+    // json_next_event call on the cursor.
+    const char *text;
+    size_t len;
+    bool boolean;
+} json_event_t;
+
+typedef struct json_cursor json_cursor_t;
+
+/// @brief Cursor over a file, read in chunks as the events are consumed
+/// @param filename The file to parse. If filename is NULL, defaults to stdin
+/// @return NULL if the file can't be opened or on allocation failure
+json_cursor_t *json_cursor_open_file(const char *filename);
+
+/// @brief Cursor over a document already in memory, the buffer has to outlive the cursor
+json_cursor_t *json_cursor_open_buffer(const char *buf, size_t len);
+
+void json_cursor_close(json_cursor_t *cursor);
+
+/// @brief Next event of the document
+/// @return False at the end of the document or on an error, json_cursor_error tells which
+bool json_next_event(json_cursor_t *cursor, json_event_t *event);
+
+/// @brief The error that stopped the cursor, NULL if it simply reached the end of the document
+const char *json_cursor_error(const json_cursor_t *cursor);
+
 #endif
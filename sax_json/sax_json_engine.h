@@ -0,0 +1,1180 @@
+// The part of the SAX engine that emits events, written once and instantiated per set of handlers.
+//
+// sax_json.c includes it with no configuration, which gives process_chunk and friends dispatching through the
+// json_sax_handler_t function pointers. Including it again with JSON_SAX_STATIC and the handler functions
+// defined gives a second copy of the engine where the handlers are direct calls the compiler can inline:
+//
+//     #define JSON_SAX_PREFIX pairs_
+//     #define JSON_SAX_STATIC
+//     #define JSON_SAX_ON_NUMBER on_number
+//     #define JSON_SAX_ON_END_OBJECT on_end_object
+//     #include "sax_json_engine.h"
+//
+// defines a static pairs_process_chunk, which can be handed to parse_file_with/parse_mapped_with. Events without a
+// JSON_SAX_ON_ handler are dropped. The error handler and the record shape keys still come from the
+// json_sax_handler_t passed to parser_init, and every configuration macro is undefined again at the end.
+//
+// Handlers: JSON_SAX_ON_START_OBJECT(ud), JSON_SAX_ON_END_OBJECT(ud), JSON_SAX_ON_START_ARRAY(ud),
+// JSON_SAX_ON_END_ARRAY(ud), JSON_SAX_ON_KEY(ud, key, len), JSON_SAX_ON_STRING(ud, value, len),
+// JSON_SAX_ON_NUMBER(ud, num_text, len), JSON_SAX_ON_DOUBLE(ud, value), JSON_SAX_ON_INT64(ud, value),
+// JSON_SAX_ON_BOOLEAN(ud, value), JSON_SAX_ON_NULL(ud),
+// JSON_SAX_ON_RECORD(ud, values) and JSON_SAX_PARSE_NUMBER(num_text, len) for the record fields.
+//
+// JSON_SAX_TAPE instead writes every event to the parser's tape through tape_push, with the numbers converted
+// and no record fast path, see tape_chunk in sax_json.c.
+
+#ifndef JSON_SAX_PREFIX
+#define JSON_SAX_PREFIX
+#endif
+#define JSON_SAX_CONCAT_(a, b) a##b
+#define JSON_SAX_CONCAT(a, b) JSON_SAX_CONCAT_(a, b)
+#define JSON_SAX_FN(name) JSON_SAX_CONCAT(JSON_SAX_PREFIX, name)
+
+#ifdef JSON_SAX_STATIC
+
+#ifdef JSON_SAX_ON_START_OBJECT
+#define JSON_EMIT_START_OBJECT(p) JSON_SAX_ON_START_OBJECT((p)->user_data)
+#else
+#define JSON_EMIT_START_OBJECT(p) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_END_OBJECT
+#define JSON_EMIT_END_OBJECT(p) JSON_SAX_ON_END_OBJECT((p)->user_data)
+#else
+#define JSON_EMIT_END_OBJECT(p) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_START_ARRAY
+#define JSON_EMIT_START_ARRAY(p) JSON_SAX_ON_START_ARRAY((p)->user_data)
+#else
+#define JSON_EMIT_START_ARRAY(p) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_END_ARRAY
+#define JSON_EMIT_END_ARRAY(p) JSON_SAX_ON_END_ARRAY((p)->user_data)
+#else
+#define JSON_EMIT_END_ARRAY(p) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_KEY
+#define JSON_EMIT_KEY(p, s, n) JSON_SAX_ON_KEY((p)->user_data, (s), (n))
+#else
+#define JSON_EMIT_KEY(p, s, n) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_STRING
+#define JSON_EMIT_STRING(p, s, n) JSON_SAX_ON_STRING((p)->user_data, (s), (n))
+#else
+#define JSON_EMIT_STRING(p, s, n) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_NUMBER
+#define JSON_EMIT_NUMBER(p, s, n) JSON_SAX_ON_NUMBER((p)->user_data, (s), (n))
+#else
+#define JSON_EMIT_NUMBER(p, s, n) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_BOOLEAN
+#define JSON_EMIT_BOOLEAN(p, b) JSON_SAX_ON_BOOLEAN((p)->user_data, (b))
+#else
+#define JSON_EMIT_BOOLEAN(p, b) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_NULL
+#define JSON_EMIT_NULL(p) JSON_SAX_ON_NULL((p)->user_data)
+#else
+#define JSON_EMIT_NULL(p) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_DOUBLE
+#define JSON_WANTS_DOUBLE(p) 1
+#define JSON_EMIT_DOUBLE(p, v, s, n) JSON_SAX_ON_DOUBLE((p)->user_data, (v))
+#else
+#define JSON_WANTS_DOUBLE(p) 0
+#define JSON_EMIT_DOUBLE(p, v, s, n) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_INT64
+#define JSON_WANTS_INT64(p) 1
+#define JSON_EMIT_INT64(p, v) JSON_SAX_ON_INT64((p)->user_data, (v))
+#else
+#define JSON_WANTS_INT64(p) 0
+#define JSON_EMIT_INT64(p, v) ((void)0)
+#endif
+#ifdef JSON_SAX_ON_RECORD
+#define JSON_SAX_HAS_RECORD 1
+#define JSON_EMIT_RECORD(p, v) JSON_SAX_ON_RECORD((p)->user_data, (v))
+#else
+#define JSON_SAX_HAS_RECORD 0
+#endif
+
+#elif defined(JSON_SAX_TAPE)
+#define JSON_EMIT_START_OBJECT(p) tape_push((p), JSON_EVENT_START_OBJECT, NULL, 0, 0.0)
+#define JSON_EMIT_END_OBJECT(p) tape_push((p), JSON_EVENT_END_OBJECT, NULL, 0, 0.0)
+#define JSON_EMIT_START_ARRAY(p) tape_push((p), JSON_EVENT_START_ARRAY, NULL, 0, 0.0)
+#define JSON_EMIT_END_ARRAY(p) tape_push((p), JSON_EVENT_END_ARRAY, NULL, 0, 0.0)
+#define JSON_EMIT_KEY(p, s, n) tape_push((p), JSON_EVENT_KEY, (s), (n), 0.0)
+#define JSON_EMIT_STRING(p, s, n) tape_push((p), JSON_EVENT_STRING, (s), (n), 0.0)
+#define JSON_EMIT_NUMBER(p, s, n) tape_push((p), JSON_EVENT_NUMBER, (s), (n), json_atof((s), (n)))
+#define JSON_WANTS_DOUBLE(p) 1
+#define JSON_EMIT_DOUBLE(p, v, s, n) tape_push((p), JSON_EVENT_NUMBER, (s), (n), (v))
+#define JSON_WANTS_INT64(p) 0
+#define JSON_EMIT_INT64(p, v) ((void)0)
+#define JSON_EMIT_BOOLEAN(p, b) tape_push((p), JSON_EVENT_BOOLEAN, NULL, 0, (b) ? 1.0 : 0.0)
+#define JSON_EMIT_NULL(p) tape_push((p), JSON_EVENT_NULL, NULL, 0, 0.0)
+#define JSON_SAX_HAS_RECORD 0
+
+#else
+#define JSON_EMIT_HANDLER(p, name, ...)         \
+    do                                          \
+    {                                           \
+        if ((p)->handlers.name)                 \
+            (p)->handlers.name(__VA_ARGS__);    \
+    } while (0)
+#define JSON_EMIT_START_OBJECT(p) JSON_EMIT_HANDLER(p, start_object, (p)->user_data)
+#define JSON_EMIT_END_OBJECT(p) JSON_EMIT_HANDLER(p, end_object, (p)->user_data)
+#define JSON_EMIT_START_ARRAY(p) JSON_EMIT_HANDLER(p, start_array, (p)->user_data)
+#define JSON_EMIT_END_ARRAY(p) JSON_EMIT_HANDLER(p, end_array, (p)->user_data)
+#define JSON_EMIT_KEY(p, s, n) JSON_EMIT_HANDLER(p, key, (p)->user_data, (s), (n))
+#define JSON_EMIT_STRING(p, s, n) JSON_EMIT_HANDLER(p, string, (p)->user_data, (s), (n))
+#define JSON_EMIT_NUMBER(p, s, n) JSON_EMIT_HANDLER(p, number, (p)->user_data, (s), (n))
+#define JSON_WANTS_DOUBLE(p) ((p)->handlers.double_value != NULL)
+#define JSON_EMIT_DOUBLE(p, v, s, n) (p)->handlers.double_value((p)->user_data, (v))
+#define JSON_WANTS_INT64(p) ((p)->handlers.int64_value != NULL)
+#define JSON_EMIT_INT64(p, v) (p)->handlers.int64_value((p)->user_data, (v))
+#define JSON_EMIT_BOOLEAN(p, b) JSON_EMIT_HANDLER(p, boolean, (p)->user_data, (b))
+#define JSON_EMIT_NULL(p) JSON_EMIT_HANDLER(p, null_value, (p)->user_data)
+// has_shape already guarantees record_shape->record is set
+#define JSON_SAX_HAS_RECORD 1
+#define JSON_EMIT_RECORD(p, v) (p)->handlers.record_shape->record((p)->user_data, (v))
+#endif
+#define JSON_WANTS_TYPED(p) (JSON_WANTS_DOUBLE(p) || JSON_WANTS_INT64(p))
+
+/// @brief Hands a scanned number to the typed handler that takes it, or to number as text
+static inline void JSON_SAX_FN(emit_scanned_number)(json_sax_parser_t *parser, const json_number_t *n, const char *text, size_t len)
+{
+    int64_t int_value;
+    if (JSON_WANTS_INT64(parser) && json_number_to_int64(n, &int_value))
+        JSON_EMIT_INT64(parser, int_value);
+    else if (JSON_WANTS_DOUBLE(parser))
+        JSON_EMIT_DOUBLE(parser, json_number_to_double(n, text, len), text, len);
+    else
+        JSON_EMIT_NUMBER(parser, text, len);
+}
+
+/// @brief Emits a complete number token, converting it first when a typed handler wants it
+static bool JSON_SAX_FN(emit_number)(json_sax_parser_t *parser, const char *text, size_t len)
+{
+    if (!JSON_WANTS_TYPED(parser))
+    {
+        JSON_EMIT_NUMBER(parser, text, len);
+        return true;
+    }
+
+    json_number_t n;
+    if (json_scan_number(text, len, &n) != len || !n.valid)
+    {
+        call_error(parser, "invalid number");
+        return false;
+    }
+    JSON_SAX_FN(emit_scanned_number)(parser, &n, text, len);
+    return true;
+}
+
+#if JSON_SAX_HAS_RECORD
+/// @brief Tries to parse a whole record of the registered shape starting at the '{' in buf[0]
+/// @return Bytes consumed including the closing '}', or 0 if the object deviates from the shape or runs
+/// past the end of buf. Nothing is emitted in that case and the generic state machine takes over.
+static size_t JSON_SAX_FN(match_record)(const json_sax_parser_t *parser, const char *buf, size_t len, double *values)
+{
+    const json_record_shape_t *shape = parser->handlers.record_shape;
+#ifndef JSON_SAX_PARSE_NUMBER
+    double (*parse_number)(const char *, size_t) = shape->parse_number ? shape->parse_number : json_atof;
+#endif
+    size_t i = 1;
+    for (size_t f = 0; f < shape->field_count; ++f)
+    {
+        if (f > 0)
+        {
+            while (i < len && iswhitespace(buf[i]))
+                i++;
+            if (i >= len || buf[i] != ',')
+                return 0;
+            i++;
+        }
+        while (i < len && iswhitespace(buf[i]))
+            i++;
+
+        // One masked compare for the quoted key
+        if (i + sizeof(uint64_t) > len)
+            return 0;
+        uint64_t key;
+        memcpy(&key, buf + i, sizeof(key));
+        if ((key & parser->key_mask[f]) != parser->key_bits[f])
+            return 0;
+        i += parser->key_len[f];
+
+        while (i < len && iswhitespace(buf[i]))
+            i++;
+        if (i >= len || buf[i] != ':')
+            return 0;
+        i++;
+        while (i < len && iswhitespace(buf[i]))
+            i++;
+
+        size_t start = i;
+        if (i >= len || !(buf[i] == '-' || (buf[i] >= '0' && buf[i] <= '9')))
+            return 0;
+        while (i < len && isnumberchar(buf[i]))
+            i++;
+        // The number may carry on into the next chunk
+        if (i >= len)
+            return 0;
+#ifdef JSON_SAX_PARSE_NUMBER
+        values[f] = JSON_SAX_PARSE_NUMBER(buf + start, i - start);
+#else
+        values[f] = parse_number(buf + start, i - start);
+#endif
+    }
+
+    while (i < len && iswhitespace(buf[i]))
+        i++;
+    if (i >= len || buf[i] != '}')
+        return 0;
+    return i + 1;
+}
+#endif
+
+#if JSON_STRUCTURAL_INDEX
+static bool JSON_SAX_FN(close_container)(json_sax_parser_t *parser, char c)
+{
+    if (ctx_stack_top(&parser->stack) != (c == '}' ? CTX_OBJECT : CTX_ARRAY))
+    {
+        call_error(parser, c == '}' ? "unexpected '}'" : "unexpected ']'");
+        return false;
+    }
+    ctx_stack_pop(&parser->stack);
+    if (c == '}')
+        JSON_EMIT_END_OBJECT(parser);
+    else
+        JSON_EMIT_END_ARRAY(parser);
+    after_value(parser);
+    return true;
+}
+#endif
+
+/// @brief Generic byte at a time state machine. process_chunk hands it the bytes the structural index can't
+/// take on its own: tokens that straddle a chunk boundary and strings with escapes.
+static bool JSON_SAX_FN(process_chunk_scalar)(json_sax_parser_t *parser, const char *buf, size_t buflen, int is_final)
+{
+    TIME_BANDWIDTH(_s, __func__, buflen);
+    size_t i = 0;
+    while (i < buflen)
+    {
+        if (parser->state <= ST_ARRAY_ELEM || parser->state == ST_DONE)
+        {
+            // Whitespace between tokens, and trailing whitespace after the document
+            i = skip_whitespace(buf, i, buflen);
+            if (i == buflen)
+                break;
+        }
+        char c = buf[i];
+
+        switch (parser->state)
+        {
+        case ST_WS:
+        case ST_VALUE:
+        {
+            if (c == '{')
+            {
+#if JSON_SAX_HAS_RECORD
+                if (parser->has_shape && ctx_stack_top(&parser->stack) == CTX_ARRAY && path_top(parser) == JSON_PATH_ALL)
+                {
+                    double values[JSON_RECORD_MAX_FIELDS];
+                    size_t consumed = JSON_SAX_FN(match_record)(parser, buf + i, buflen - i, values);
+                    if (consumed)
+                    {
+                        JSON_EMIT_RECORD(parser, values);
+                        parser->state = ST_ARRAY_ELEM;
+                        i += consumed;
+                        continue;
+                    }
+                }
+#endif
+                JSON_EMIT_START_OBJECT(parser);
+                if (!ctx_stack_push(&parser->stack, CTX_OBJECT, value_path(parser)))
+                {
+                    call_error(parser, "stack push failed");
+                    RETURN_VAL(_s, false);
+                }
+                parser->state = ST_OBJECT_KEY;
+                i++;
+                continue;
+            }
+            else if (c == '[')
+            {
+                JSON_EMIT_START_ARRAY(parser);
+                if (!ctx_stack_push(&parser->stack, CTX_ARRAY, value_path(parser)))
+                {
+                    call_error(parser, "stack push failed");
+                    RETURN_VAL(_s, false);
+                }
+                parser->state = ST_ARRAY_ELEM;
+                i++;
+                continue;
+            }
+            else if (c == '"')
+            {
+                parser->strbuf.len = 0;
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 't')
+            {
+                parser->state = ST_TRUE;
+                parser->numbuf.len = 0;
+
+                if (!sbuf_append_char(&parser->numbuf, 't'))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                i++;
+                continue;
+            }
+            else if (c == 'f')
+            {
+                parser->state = ST_FALSE;
+                parser->numbuf.len = 0;
+                if (!sbuf_append_char(&parser->numbuf, 'f'))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                i++;
+                continue;
+            }
+            else if (c == 'n')
+            {
+                parser->state = ST_NULL;
+                parser->numbuf.len = 0;
+                if (!sbuf_append_char(&parser->numbuf, 'n'))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                i++;
+                continue;
+            }
+            else if (c == '-' || (c >= '0' && c <= '9'))
+            {
+                parser->numbuf.len = 0;
+                parser->state = ST_NUMBER;
+                continue;
+            }
+            else if (c == ']')
+            {
+                if (ctx_stack_top(&parser->stack) != CTX_ARRAY)
+                {
+                    call_error(parser, "unexpected ']'");
+                    RETURN_VAL(_s, false);
+                }
+                ctx_stack_pop(&parser->stack);
+                JSON_EMIT_END_ARRAY(parser);
+                if (parser->stack.len == 0)
+                    parser->state = ST_DONE;
+                else
+                {
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
+                }
+                i++;
+                continue;
+            }
+            else if (c == '}')
+            {
+                if (ctx_stack_top(&parser->stack) != CTX_OBJECT)
+                {
+                    call_error(parser, "unexpected '}'");
+                    return false;
+                }
+                ctx_stack_pop(&parser->stack);
+                JSON_EMIT_END_OBJECT(parser);
+                if (parser->stack.len == 0)
+                    parser->state = ST_DONE;
+                else
+                {
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
+                }
+                i++;
+                continue;
+            }
+            else if (c == ',')
+            {
+                ctx_type_t top = ctx_stack_top(&parser->stack);
+                if (top == CTX_ARRAY)
+                    parser->state = ST_ARRAY_ELEM;
+                else if (top == CTX_OBJECT)
+                    parser->state = ST_OBJECT_KEY;
+                else
+                {
+                    call_error(parser, "unexpected ',' in root");
+                    RETURN_VAL(_s, false);
+                }
+                i++;
+                continue;
+            }
+            else if (c == ':')
+            {
+                parser->state = ST_AFTER_COLON;
+                i++;
+                continue;
+            }
+            else
+            {
+                call_error(parser, "unexpected character while parsing value");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ST_OBJECT_KEY:
+        {
+            if (c == '}')
+            {
+                if (ctx_stack_top(&parser->stack) != CTX_OBJECT)
+                {
+                    call_error(parser, "unexpected '}'");
+                    RETURN_VAL(_s, false);
+                }
+                ctx_stack_pop(&parser->stack);
+                JSON_EMIT_END_OBJECT(parser);
+                if (parser->stack.len == 0)
+                    parser->state = ST_DONE;
+                else
+                {
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
+                }
+                i++;
+                continue;
+            }
+            if (c == '"')
+            {
+                parser->strbuf.len = 0;
+                parser->state = ST_STRING;
+                parser->string_is_key = true;
+                i++;
+                continue;
+            }
+            call_error(parser, "expected object key string");
+            RETURN_VAL(_s, false);
+        }
+        break;
+        case ST_AFTER_COLON:
+        {
+            parser->state = ST_VALUE;
+            continue; // re-evaluate the same char in ST_VALUE
+        }
+        break;
+        case ST_ARRAY_ELEM:
+        {
+            if (c == ']')
+            {
+                if (ctx_stack_top(&parser->stack) != CTX_ARRAY)
+                {
+                    call_error(parser, "unexpected ']'");
+                    return false;
+                }
+                ctx_stack_pop(&parser->stack);
+                JSON_EMIT_END_ARRAY(parser);
+                if (parser->stack.len == 0)
+                    parser->state = ST_DONE;
+                else
+                {
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    parser->state = (top == CTX_ARRAY) ? ST_ARRAY_ELEM : ST_AFTER_COLON;
+                }
+                i++;
+                continue;
+            }
+            parser->state = ST_VALUE;
+            continue;
+        }
+        break;
+        case ST_STRING:
+        {
+            if (parser->u_remaining > 0)
+            {
+                if (!parse_unicode_escape(parser, buf, &i, buflen))
+                    RETURN_VAL(_s, false);
+                continue;
+            }
+            if (parser->expecting_surrogate && c != '\\')
+            {
+                call_error(parser, "unpaired high surrogate");
+                RETURN_VAL(_s, false);
+            }
+
+            size_t start = i;
+            i = find_quote_or_escape(buf, i, buflen);
+            if (!check_string_utf8(parser, buf + start, i - start, i < buflen))
+                RETURN_VAL(_s, false);
+            if (i == buflen || buf[i] == '\\')
+            {
+                // The string carries on past an escape or the end of the chunk, keep what we have so far
+                if (!sbuf_append_bytes(&parser->strbuf, buf + start, i - start))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                if (i < buflen)
+                {
+                    parser->state = ST_STRING_ESC;
+                    i++;
+                }
+                continue;
+            }
+
+            // Closing quote, the string is handed out straight from buf unless part of it had to be buffered
+            const char *str = buf + start;
+            size_t len = i - start;
+            if (parser->strbuf.len > 0)
+            {
+                if (!sbuf_append_bytes(&parser->strbuf, str, len))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                str = parser->strbuf.buf;
+                len = parser->strbuf.len;
+            }
+
+            parser->state = ST_AFTER_COLON;
+            if (parser->string_is_key)
+            {
+                if (ctx_stack_top(&parser->stack) == CTX_OBJECT)
+                {
+                    if (path_match_key(parser, str, len))
+                        JSON_EMIT_KEY(parser, str, len);
+                    else
+                        begin_skip(parser);
+                }
+            }
+            else
+                JSON_EMIT_STRING(parser, str, len);
+
+            parser->string_is_key = false;
+            parser->strbuf.len = 0;
+            i++;
+            continue;
+        }
+        break;
+        case ST_STRING_ESC:
+        {
+            if (parser->expecting_surrogate && c != 'u')
+            {
+                call_error(parser, "unpaired high surrogate");
+                RETURN_VAL(_s, false);
+            }
+            if (c == '"' || c == '\\' || c == '/')
+            {
+                if (!sbuf_append_char(&parser->strbuf, c))
+                {
+                    call_error(parser, "alloc failure");
+                    RETURN_VAL(_s, false);
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 'b')
+            {
+                if (!sbuf_append_char(&parser->strbuf, '\b'))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 'f')
+            {
+                if (!sbuf_append_char(&parser->strbuf, '\f'))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 'n')
+            {
+                if (!sbuf_append_char(&parser->strbuf, '\n'))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 'r')
+            {
+                if (!sbuf_append_char(&parser->strbuf, '\r'))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 't')
+            {
+                if (!sbuf_append_char(&parser->strbuf, '\t'))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else if (c == 'u')
+            {
+                parser->u_remaining = 4;
+                parser->u_value = 0;
+                parser->state = ST_STRING;
+                i++;
+                continue;
+            }
+            else
+            {
+                call_error(parser, "invalid escape in string");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ST_NUMBER:
+        {
+            // TODO: There might be a better way to do this, but this is already quite a bit faster than before
+            if (isnumberchar(c))
+            {
+                size_t start = i;
+                while (i < buflen && isnumberchar(buf[i]))
+                    i++;
+                if (i < buflen && parser->numbuf.len == 0)
+                {
+                    parser->num_start = start;
+                }
+                else
+                {
+                    size_t end = i - start;
+                    if (!sbuf_append_bytes(&parser->numbuf, buf + start, end))
+                    {
+                        call_error(parser, "alloc failure");
+                        RETURN_VAL(_s, false);
+                    }
+                }
+
+                // Just continue then the loop will fall into the else branch if the number was completed
+                continue;
+            }
+            else
+            {
+                bool ok;
+                if (parser->numbuf.len == 0)
+                    ok = JSON_SAX_FN(emit_number)(parser, buf + parser->num_start, i - parser->num_start);
+                else
+                    ok = JSON_SAX_FN(emit_number)(parser, parser->numbuf.buf, parser->numbuf.len);
+                if (!ok)
+                    RETURN_VAL(_s, false);
+
+                parser->numbuf.len = 0;
+                parser->num_start = 0;
+                if (parser->numbuf.cap > 0)
+                    parser->numbuf.buf[0] = '\0';
+                ctx_type_t top = ctx_stack_top(&parser->stack);
+                if (top == CTX_ARRAY)
+                    parser->state = ST_ARRAY_ELEM;
+                else if (top == CTX_OBJECT)
+                    parser->state = ST_AFTER_COLON;
+                else
+                    parser->state = ST_DONE;
+                continue;
+            }
+        }
+        break;
+        case ST_TRUE:
+        {
+            const char *match = "rue";
+            size_t have = parser->numbuf.len;
+            if (have == 0)
+            {
+                call_error(parser, "internal true parser error");
+                RETURN_VAL(_s, false);
+            }
+            size_t expect_index = have - 1;
+            if (expect_index >= 3)
+            {
+                call_error(parser, "internal true length error");
+                RETURN_VAL(_s, false);
+            }
+
+            if (c == match[expect_index])
+            {
+                if (!sbuf_append_char(&parser->numbuf, c))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                i++;
+                if (parser->numbuf.len == 4)
+                {
+                    JSON_EMIT_BOOLEAN(parser, true);
+                    parser->numbuf.len = 0;
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    if (top == CTX_ARRAY)
+                        parser->state = ST_ARRAY_ELEM;
+                    else if (top == CTX_OBJECT)
+                        parser->state = ST_AFTER_COLON;
+                    else
+                        parser->state = ST_DONE;
+                }
+                continue;
+            }
+            else
+            {
+                call_error(parser, "invalid token while parsing 'true'");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ST_FALSE:
+        {
+            const char *match = "alse";
+            size_t have = parser->numbuf.len;
+            if (have == 0)
+            {
+                call_error(parser, "internal true parser error");
+                RETURN_VAL(_s, false);
+            }
+            size_t expect_index = have - 1;
+            if (expect_index >= 4)
+            {
+                call_error(parser, "internal true length error");
+                RETURN_VAL(_s, false);
+            }
+
+            if (c == match[expect_index])
+            {
+                if (!sbuf_append_char(&parser->numbuf, c))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                i++;
+                if (parser->numbuf.len == 5)
+                {
+                    JSON_EMIT_BOOLEAN(parser, false);
+                    parser->numbuf.len = 0;
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    if (top == CTX_ARRAY)
+                        parser->state = ST_ARRAY_ELEM;
+                    else if (top == CTX_OBJECT)
+                        parser->state = ST_AFTER_COLON;
+                    else
+                        parser->state = ST_DONE;
+                }
+                continue;
+            }
+            else
+            {
+                call_error(parser, "invalid token while parsing 'true'");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ST_NULL:
+        {
+            const char *match = "ull";
+            size_t have = parser->numbuf.len;
+            if (have == 0)
+            {
+                call_error(parser, "internal true parser error");
+                return false;
+            }
+            size_t expect_index = have - 1;
+            if (expect_index >= 3)
+            {
+                call_error(parser, "internal true length error");
+                return false;
+            }
+
+            if (c == match[expect_index])
+            {
+                if (!sbuf_append_char(&parser->numbuf, c))
+                {
+                    call_error(parser, "alloc failure");
+                }
+                i++;
+                if (parser->numbuf.len == 4)
+                {
+                    JSON_EMIT_NULL(parser);
+                    parser->numbuf.len = 0;
+                    ctx_type_t top = ctx_stack_top(&parser->stack);
+                    if (top == CTX_ARRAY)
+                        parser->state = ST_ARRAY_ELEM;
+                    else if (top == CTX_OBJECT)
+                        parser->state = ST_AFTER_COLON;
+                    else
+                        parser->state = ST_DONE;
+                }
+                continue;
+            }
+            else
+            {
+                call_error(parser, "invalid token while parsing 'true'");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ST_SKIP:
+        {
+            i = skip_value(parser, buf, i, buflen);
+            if (parser->state == ST_ERROR)
+                RETURN_VAL(_s, false);
+            continue;
+        }
+        break;
+        default:
+            call_error(parser, "unexpected parser state");
+            RETURN_VAL(_s, false);
+        }
+    }
+
+    if (is_final)
+    {
+        // A number at the root has nothing after it to end it but the end of input
+        if (parser->state == ST_NUMBER && parser->stack.len == 0)
+        {
+            if (!JSON_SAX_FN(emit_number)(parser, parser->numbuf.buf, parser->numbuf.len))
+                RETURN_VAL(_s, false);
+            parser->numbuf.len = 0;
+            parser->state = ST_DONE;
+        }
+        if (parser->state == ST_DONE || parser->stack.len == 0)
+        {
+            RETURN_VAL(_s, true);
+        }
+        else
+        {
+            call_error(parser, "unexpected end of input");
+            RETURN_VAL(_s, false);
+        }
+    }
+
+    RETURN_VAL(_s, true);
+}
+
+/// @brief Feeds the next chunk of the document to the parser. Tokens may straddle chunks. For a windowed parser
+/// a token cut by the end of the chunk stops it instead, parser->consumed tells the caller where the token starts.
+/// @param is_final Nonzero for the last chunk, the document has to be complete at its end
+/// @return False on a parse error, the error handler has already been called
+static bool JSON_SAX_FN(process_chunk)(json_sax_parser_t *parser, const char *buf, size_t buflen, int is_final)
+{
+#if !JSON_STRUCTURAL_INDEX
+    return JSON_SAX_FN(process_chunk_scalar)(parser, buf, buflen, is_final);
+#else
+    TIME_BANDWIDTH(_s, __func__, buflen);
+    if (parser->state == ST_ERROR)
+        RETURN_VAL(_s, false);
+
+    // The index has to start on a token boundary, so a token left open by the last chunk is finished first
+    size_t open = 0;
+    if (in_token(parser->state))
+    {
+        open = open_token_length(parser, buf, buflen);
+        bool ok = JSON_SAX_FN(process_chunk_scalar)(parser, buf, open, is_final && open == buflen);
+        if (!ok || open == buflen)
+            RETURN_VAL(_s, ok);
+        if (in_token(parser->state))
+        {
+            ok = JSON_SAX_FN(process_chunk_scalar)(parser, buf + open, buflen - open, is_final);
+            RETURN_VAL(_s, ok);
+        }
+    }
+
+    if (parser->state == ST_SKIP)
+    {
+        open = skip_value(parser, buf, open, buflen);
+        if (parser->state == ST_ERROR)
+            RETURN_VAL(_s, false);
+        if (parser->state == ST_SKIP)
+        {
+            if (is_final)
+            {
+                call_error(parser, "unexpected end of input");
+                RETURN_VAL(_s, false);
+            }
+            RETURN_VAL(_s, true);
+        }
+    }
+
+    const char *text = buf + open;
+    size_t len = buflen - open;
+    json_index_t ix = {0};
+    ix.buf = text;
+    ix.len = len;
+    ix.positions = parser->index;
+
+    size_t pos;
+    while (index_peek(&ix, &pos))
+    {
+        ix.at++;
+        char c = text[pos];
+        if (parser->state == ST_DONE)
+        {
+            call_error(parser, "unexpected character after the end of the document");
+            RETURN_VAL(_s, false);
+        }
+        if (parser->state == ST_OBJECT_KEY && c != '"' && c != '}')
+        {
+            call_error(parser, "expected object key string");
+            RETURN_VAL(_s, false);
+        }
+
+        switch (c)
+        {
+        case '{':
+        {
+#if JSON_SAX_HAS_RECORD
+            if (parser->has_shape && ctx_stack_top(&parser->stack) == CTX_ARRAY && path_top(parser) == JSON_PATH_ALL)
+            {
+                double values[JSON_RECORD_MAX_FIELDS];
+                size_t consumed = JSON_SAX_FN(match_record)(parser, text + pos, len - pos, values);
+                if (consumed)
+                {
+                    JSON_EMIT_RECORD(parser, values);
+                    parser->state = ST_ARRAY_ELEM;
+                    index_skip_to(&ix, pos + consumed);
+                    break;
+                }
+                if (JSON_HOLD_TOKEN(parser, is_final) && len - pos < JSON_RECORD_HOLD_MAX && !memchr(text + pos, '}', len - pos))
+                {
+                    // Cut by the end of the chunk, the next read brings the whole record for the fast path
+                    parser->consumed = open + pos;
+                    RETURN_VAL(_s, true);
+                }
+            }
+#endif
+            JSON_EMIT_START_OBJECT(parser);
+            if (!ctx_stack_push(&parser->stack, CTX_OBJECT, value_path(parser)))
+            {
+                call_error(parser, "stack push failed");
+                RETURN_VAL(_s, false);
+            }
+            parser->state = ST_OBJECT_KEY;
+        }
+        break;
+        case '[':
+        {
+            JSON_EMIT_START_ARRAY(parser);
+            if (!ctx_stack_push(&parser->stack, CTX_ARRAY, value_path(parser)))
+            {
+                call_error(parser, "stack push failed");
+                RETURN_VAL(_s, false);
+            }
+            parser->state = ST_ARRAY_ELEM;
+        }
+        break;
+        case '}':
+        case ']':
+        {
+            if (!JSON_SAX_FN(close_container)(parser, c))
+                RETURN_VAL(_s, false);
+        }
+        break;
+        case ',':
+        {
+            ctx_type_t top = ctx_stack_top(&parser->stack);
+            if (top == CTX_ARRAY)
+                parser->state = ST_ARRAY_ELEM;
+            else if (top == CTX_OBJECT)
+                parser->state = ST_OBJECT_KEY;
+            else
+            {
+                call_error(parser, "unexpected ',' in root");
+                RETURN_VAL(_s, false);
+            }
+        }
+        break;
+        case ':':
+        {
+            parser->state = ST_AFTER_COLON;
+        }
+        break;
+        case '"':
+        {
+            // Inside a string nothing but the closing quote makes it into the index
+            size_t close;
+            if (!index_peek(&ix, &close))
+            {
+                if (JSON_HOLD_TOKEN(parser, is_final))
+                {
+                    parser->consumed = open + pos;
+                    RETURN_VAL(_s, true);
+                }
+                bool ok = JSON_SAX_FN(process_chunk_scalar)(parser, text + pos, len - pos, is_final);
+                RETURN_VAL(_s, ok);
+            }
+            ix.at++;
+
+            const char *str = text + pos + 1;
+            size_t str_len = close - pos - 1;
+            if (memchr(str, '\\', str_len))
+            {
+                // Escapes are decoded by the state machine
+                if (!JSON_SAX_FN(process_chunk_scalar)(parser, text + pos, close + 1 - pos, 0))
+                    RETURN_VAL(_s, false);
+                if (in_token(parser->state))
+                {
+                    bool ok = JSON_SAX_FN(process_chunk_scalar)(parser, text + close + 1, len - close - 1, is_final);
+                    RETURN_VAL(_s, ok);
+                }
+            }
+            else if (!index_utf8_valid(&ix, pos + 1, close + 1) && !check_string_utf8(parser, str, str_len, true))
+            {
+                RETURN_VAL(_s, false);
+            }
+            else if (parser->state == ST_OBJECT_KEY)
+            {
+                parser->state = ST_AFTER_COLON;
+                if (ctx_stack_top(&parser->stack) == CTX_OBJECT)
+                {
+                    if (path_match_key(parser, str, str_len))
+                        JSON_EMIT_KEY(parser, str, str_len);
+                    else
+                        begin_skip(parser);
+                }
+            }
+            else
+            {
+                JSON_EMIT_STRING(parser, str, str_len);
+                after_value(parser);
+            }
+
+            if (parser->state == ST_SKIP)
+            {
+                // The key is outside the projection, its value is never indexed
+                size_t end = skip_value(parser, text, close + 1, len);
+                if (parser->state == ST_ERROR)
+                    RETURN_VAL(_s, false);
+                index_jump(&ix, end);
+            }
+        }
+        break;
+        case 't':
+        case 'f':
+        case 'n':
+        {
+            const char *word = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+            size_t word_len = (c == 'f') ? 5 : 4;
+            if (len - pos < word_len)
+            {
+                // Cut by the end of the chunk
+                if (JSON_HOLD_TOKEN(parser, is_final))
+                {
+                    parser->consumed = open + pos;
+                    RETURN_VAL(_s, true);
+                }
+                bool ok = JSON_SAX_FN(process_chunk_scalar)(parser, text + pos, len - pos, is_final);
+                RETURN_VAL(_s, ok);
+            }
+            if (memcmp(text + pos, word, word_len) != 0 || !token_ends_at(text, pos + word_len, len))
+            {
+                call_error(parser, "invalid literal");
+                RETURN_VAL(_s, false);
+            }
+            if (c == 'n')
+                JSON_EMIT_NULL(parser);
+            else
+                JSON_EMIT_BOOLEAN(parser, c == 't');
+            after_value(parser);
+        }
+        break;
+        default:
+        {
+            if (c != '-' && !(c >= '0' && c <= '9'))
+            {
+                call_error(parser, "unexpected character while parsing value");
+                RETURN_VAL(_s, false);
+            }
+            // With a typed handler the conversion is the scan that finds the end of the number
+            json_number_t n;
+            bool typed = JSON_WANTS_TYPED(parser);
+            size_t end = pos + 1;
+            if (typed)
+                end = pos + json_scan_number(text + pos, len - pos, &n);
+            else
+            {
+                while (end < len && isnumberchar(text[end]))
+                    end++;
+            }
+            if (end == len)
+            {
+                if (JSON_HOLD_TOKEN(parser, is_final))
+                {
+                    parser->consumed = open + pos;
+                    RETURN_VAL(_s, true);
+                }
+                bool ok = JSON_SAX_FN(process_chunk_scalar)(parser, text + pos, len - pos, is_final);
+                RETURN_VAL(_s, ok);
+            }
+            if (!token_ends_at(text, end, len) || (typed && !n.valid))
+            {
+                call_error(parser, "unexpected character while parsing number");
+                RETURN_VAL(_s, false);
+            }
+            if (typed)
+                JSON_SAX_FN(emit_scanned_number)(parser, &n, text + pos, end - pos);
+            else
+                JSON_EMIT_NUMBER(parser, text + pos, end - pos);
+            after_value(parser);
+        }
+        break;
+        }
+    }
+
+    if (is_final && parser->state != ST_DONE && parser->stack.len != 0)
+    {
+        call_error(parser, "unexpected end of input");
+        RETURN_VAL(_s, false);
+    }
+    RETURN_VAL(_s, true);
+#endif
+}
+
+#undef JSON_EMIT_START_OBJECT
+#undef JSON_EMIT_END_OBJECT
+#undef JSON_EMIT_START_ARRAY
+#undef JSON_EMIT_END_ARRAY
+#undef JSON_EMIT_KEY
+#undef JSON_EMIT_STRING
+#undef JSON_EMIT_NUMBER
+#undef JSON_EMIT_BOOLEAN
+#undef JSON_EMIT_NULL
+#undef JSON_EMIT_RECORD
+#undef JSON_EMIT_DOUBLE
+#undef JSON_EMIT_INT64
+#undef JSON_WANTS_DOUBLE
+#undef JSON_WANTS_INT64
+#undef JSON_WANTS_TYPED
+#undef JSON_EMIT_HANDLER
+#undef JSON_SAX_HAS_RECORD
+#undef JSON_SAX_FN
+#undef JSON_SAX_CONCAT
+#undef JSON_SAX_CONCAT_
+#undef JSON_SAX_PREFIX
+#undef JSON_SAX_STATIC
+#undef JSON_SAX_TAPE
+#undef JSON_SAX_ON_START_OBJECT
+#undef JSON_SAX_ON_END_OBJECT
+#undef JSON_SAX_ON_START_ARRAY
+#undef JSON_SAX_ON_END_ARRAY
+#undef JSON_SAX_ON_KEY
+#undef JSON_SAX_ON_STRING
+#undef JSON_SAX_ON_NUMBER
+#undef JSON_SAX_ON_BOOLEAN
+#undef JSON_SAX_ON_NULL
+#undef JSON_SAX_ON_DOUBLE
+#undef JSON_SAX_ON_INT64
+#undef JSON_SAX_ON_RECORD
+#undef JSON_SAX_PARSE_NUMBER